@@ -0,0 +1,26 @@
+#ifndef AUGMENT_H
+#define AUGMENT_H
+
+#include <cstdint>
+
+// Random distortions applied to training images as batches are assembled.
+// Zero turns a distortion off.
+struct AugmentConfig {
+    float max_shift = 2.0f;         // pixels, uniform in [-max_shift, max_shift] on each axis
+    float max_rotation = 10.0f;     // degrees, uniform in [-max_rotation, max_rotation]
+    float elastic_amplitude = 1.5f; // pixels, largest displacement of the elastic field
+    float elastic_spacing = 7.0f;   // pixels between its random control points, larger is smoother
+    float noise = 8.0f;             // uniform noise in [-noise, noise] grey levels
+};
+
+// Mixes (seed, epoch, index) into the seed of one image's distortions
+uint64_t augment_seed(uint64_t seed, int epoch, int index);
+
+// dst = src (rows x cols, 8-bit) shifted, rotated about its centre and
+// elastically distorted, sampled bilinearly with black outside the image,
+// then noised. Depends only on its arguments, so the same (seed, epoch,
+// index) gives the same image on any thread. src and dst must not overlap.
+void augment_image(const unsigned char* src, unsigned char* dst, int rows, int cols,
+                   const AugmentConfig& config, uint64_t image_seed);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// What a backend can do, reported so callers and benchmarks can compare them
+struct BackendCaps {
+    int vector_width;       // floats per SIMD register, 1 for the scalar reference
+    bool fma;               // fused multiply-add in the inner loops
+    bool device_memory;     // buffers live on a separate device, copies are real transfers
+    int max_threads;        // worker threads a kernel may use
+};
+
+// Algorithms of conv2d_forward. CONV_AUTO lets the backend pick from the
+// layer shape; a forced algorithm that cannot run a shape falls back to it.
+enum conv_algo { CONV_AUTO, CONV_DIRECT, CONV_IM2COL, CONV_WINOGRAD, CONV_FFT, CONV_NCHWC };
+
+// One implementation of the kernels.h and memory.h API
+struct Backend {
+    const char* name;
+    const char* description;
+    BackendCaps caps;
+    bool (*available)();    // can this machine run it (CPU flags, device present)
+
+    void (*convolution_forward)(float* input, float* kernel, float* output,
+                                int input_width, int kernel_size, int output_width);
+    void (*conv2d_forward)(float* input, float* weights, float* bias, float* output,
+                           int batch_size, int in_channels, int height, int width,
+                           int out_channels, int kernel_size, int stride, int padding, int algo);
+    void (*relu_activation)(float* input, float* output, int size);
+    void (*pixels_to_float)(unsigned char* pixels, float* output, float scale, float shift, int size);
+    void (*softmax)(float* input, float* output, int batch_size, int size);
+    void (*fc_forward)(float* input, float* weights, float* bias,
+                       float* output, int batch_size, int input_size, int output_size);
+    void (*fc_backward)(float* input, float* weights, float* grad_output,
+                        float* grad_input, float* grad_weights, float* grad_bias,
+                        int batch_size, int input_size, int output_size);
+    void (*relu_backward)(float* output, float* grad_output, float* grad_input, int size);
+    void (*softmax_cross_entropy_backward)(float* probs, int* labels, float* grad,
+                                           int batch_size, int num_classes);
+    void (*softmax_cross_entropy)(float* logits, int* labels, float* loss, int* predictions,
+                                  float* grad, int batch_size, int num_classes);
+    void (*sgd_update)(float* params, float* grads, float learning_rate, int size);
+
+    void* (*device_malloc)(size_t size);
+    void (*device_free)(void* ptr);
+    void (*copy_to_device)(void* dest, void* src, size_t size);
+    void (*copy_to_host)(void* dest, void* src, size_t size);
+};
+
+// Every function pointer of Backend, used by the backends to fill their table
+#define NN_BACKEND_FUNCTIONS(X) \
+    X(convolution_forward) X(conv2d_forward) X(relu_activation) X(pixels_to_float) X(softmax) \
+    X(fc_forward) X(fc_backward) X(relu_backward) X(softmax_cross_entropy_backward) \
+    X(softmax_cross_entropy) X(sgd_update) \
+    X(device_malloc) X(device_free) X(copy_to_device) X(copy_to_host)
+
+// Built-in backends. cuda_backend only exists when convolution.cu is linked in.
+extern "C" {
+    const Backend* scalar_backend();
+    const Backend* avx2_backend();
+    const Backend* avx512_backend();
+    const Backend* cuda_backend();
+}
+
+// Registry, in order of preference. The active backend is picked on first
+// use: the one named by the NN_BACKEND environment variable if it is
+// available here, otherwise the first available one.
+void register_backend(const Backend* backend);
+int backend_count();
+const Backend* backend_at(int index);
+const Backend* find_backend(const char* name);
+const Backend* active_backend();
+// Returns false, keeping the current backend, if `name` is unknown or unavailable.
+// Buffers belong to the backend that allocated them, so switch before allocating.
+bool select_backend(const char* name);
+// One-line summary of the backend on stderr, with the other diagnostics
+void print_backend(const Backend* backend);
+// Algorithm conv2d_forward asks the active backend for, CONV_AUTO by default
+void set_conv_algo(conv_algo algo);
+conv_algo get_conv_algo();
+const char* conv_algo_name(conv_algo algo);
+
+// Transformed filters (Winograd, FFT spectra, NCHWc blocks) cached per
+// weights buffer for the CPU backends. One cache serves them all, so a write
+// or free through any backend drops the entries every backend made from that
+// buffer. `owner` identifies the backend, whose layout the entry is in, and
+// `key` the algorithm and the shape it was transformed for.
+typedef std::array<int, 6> FilterKey;
+typedef std::shared_ptr<const std::vector<float>> FilterData;
+FilterData filter_cache_find(const void* owner, const float* weights, const FilterKey& key);
+// Returns the entry already cached if another thread added one meanwhile
+FilterData filter_cache_insert(const void* owner, const float* weights, size_t bytes, const FilterKey& key,
+                               FilterData data);
+// Drops every entry whose weights overlap [begin, begin + bytes)
+void filter_cache_forget(const void* begin, size_t bytes);
+
+#endif
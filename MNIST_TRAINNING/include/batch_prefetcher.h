@@ -0,0 +1,69 @@
+#ifndef BATCH_PREFETCHER_H
+#define BATCH_PREFETCHER_H
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "augment.h"
+#include "data_loader.h"
+
+// One assembled batch: `size` images of `image_size` pixels each, in the
+// shuffled order of its epoch, and their labels
+struct Batch {
+    unsigned char* pixels;      // size x image_size, 64-byte aligned
+    int* labels;
+    int size;                   // batch_size, the last batch of an epoch may be short
+    int epoch;
+};
+
+// Builds batches on background threads while the caller trains on the
+// previous ones. Every epoch visits the dataset in a fresh permutation
+// drawn from (seed, epoch), and augmented images depend only on (seed,
+// epoch, index), so a run is reproducible whatever the number of workers.
+// Batches are gathered into a ring of `depth` + 1 buffers: the workers stay
+// at most `depth` batches ahead, and the caller owns one. Workers claim
+// batches in order along with a free buffer, and next() hands them out in
+// that order.
+class BatchPrefetcher {
+public:
+    // augment may be null for the images as stored; it is copied
+    BatchPrefetcher(const MnistDataset& data, int batch_size, int epochs, unsigned seed, int depth = 3,
+                    int workers = 1, const AugmentConfig* augment = nullptr);
+    ~BatchPrefetcher();
+    BatchPrefetcher(const BatchPrefetcher&) = delete;
+    BatchPrefetcher& operator=(const BatchPrefetcher&) = delete;
+
+    // Batches per epoch
+    int batches() const { return (num_images_ + batch_size_ - 1) / batch_size_; }
+    // The next batch, waiting for it if the workers are behind; nullptr
+    // after the last epoch. It stays valid until the following call.
+    const Batch* next();
+
+private:
+    void produce();
+    void fill(Batch& b, long sequence, std::vector<int>& order, int& order_epoch);
+
+    const MnistDataset& data_;
+    int batch_size_;
+    int epochs_;
+    unsigned seed_;
+    int num_images_;
+    size_t image_size_;
+    bool augmenting_;
+    AugmentConfig augment_;
+
+    std::vector<Batch> slots_;
+    std::vector<int> free_;             // slot indices
+    std::map<long, int> ready_;         // batch sequence number -> slot
+    long claimed_ = 0;                  // batches handed to workers so far
+    long consumed_ = 0;                 // batches handed to the caller so far
+    int held_ = -1;                     // slot the caller is reading
+    bool stop_ = false;
+    std::mutex lock_;
+    std::condition_variable slot_freed_, batch_ready_;
+    std::vector<std::thread> workers_;
+};
+
+#endif
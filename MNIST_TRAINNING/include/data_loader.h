@@ -1,10 +1,66 @@
 #ifndef DATA_LOADER_H
 #define DATA_LOADER_H
 
+#include <cstddef>
 #include <vector>
 #include <string>
 
 std::vector<int> load_mnist_labels(const std::string& path, int& num_labels);
+// Pixels as stored, 0-255, num_images x rows x cols
+std::vector<unsigned char> load_mnist_pixels(const std::string& path, int& num_images, int& rows, int& cols);
+// The same scaled to [0, 1], four times the memory
 std::vector<float> load_mnist_images(const std::string& path, int& num_images, int& rows, int& cols);
 
-#endif
\ No newline at end of file
+// Records [first, first + count) only, inflated from the nearest access
+// point of the file's gzip index (gz_index.h) instead of from byte 0, so
+// jobs loading disjoint shards each decompress little more than their own.
+// The counts returned are the whole file's.
+std::vector<int> load_mnist_labels(const std::string& path, int first, int count, int& num_labels);
+std::vector<unsigned char> load_mnist_pixels(const std::string& path, int first, int count,
+                                             int& num_images, int& rows, int& cols);
+std::vector<float> load_mnist_images(const std::string& path, int first, int count,
+                                     int& num_images, int& rows, int& cols);
+
+// Read-only view of `size` elements owned by someone else
+template <typename T>
+struct Span {
+    const T* data = nullptr;
+    size_t size = 0;
+
+    const T& operator[](size_t i) const { return data[i]; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + size; }
+};
+
+// An MNIST image file and its label file, decoded once into a cache file
+// beside the images (<images_path>.cache) that later runs map read-only.
+// The cache records the mtimes of both sources and a crc32 of its contents;
+// it is rebuilt when either source changes or the check fails, and written
+// to a temporary file then renamed, so concurrent jobs never see half of
+// one. Where the cache cannot be written the data is kept in memory.
+// Throws std::runtime_error when the sources cannot be read.
+class MnistDataset {
+public:
+    MnistDataset(const std::string& images_path, const std::string& labels_path);
+    ~MnistDataset();
+    MnistDataset(const MnistDataset&) = delete;
+    MnistDataset& operator=(const MnistDataset&) = delete;
+
+    // num_images x rows x cols pixels as stored, 0-255; scale them per batch
+    // (pixels_to_float) rather than holding the dataset as floats
+    Span<unsigned char> images;
+    Span<int> labels;       // num_images
+    int num_images = 0;
+    int rows = 0;
+    int cols = 0;
+
+private:
+    bool map_cache(const std::string& path, long long images_mtime, long long labels_mtime);
+
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    std::vector<unsigned char> owned_images_;
+    std::vector<int> owned_labels_;
+};
+
+#endif
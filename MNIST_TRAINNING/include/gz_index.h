@@ -0,0 +1,54 @@
+#ifndef GZ_INDEX_H
+#define GZ_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Random access into a gzip file. Inflate can only start where it has the
+// 32 KB of output preceding that point, so one full pass records an access
+// point at a deflate block boundary roughly every `span` output bytes: the
+// compressed and uncompressed offsets, the bit position within the byte,
+// and that 32 KB window. A read then inflates from the nearest point at or
+// before it instead of from byte 0 (the scheme of zlib's examples/zran.c).
+//
+// The index lives beside the file (<path>.gzidx), keyed to its size and
+// mtime, and is built on first use, then written to a temporary file and
+// renamed so concurrent jobs never see half of one. Where it cannot be
+// written it is still used from memory. Files that are not gzip compressed
+// are read directly at the offset.
+// Throws std::runtime_error when the file cannot be read or is corrupt.
+class GzIndex {
+public:
+    static const size_t default_span = 1 << 20;
+
+    explicit GzIndex(const std::string& path, size_t span = default_span);
+
+    // Copies `size` uncompressed bytes starting at `offset` into dst
+    void read(size_t offset, unsigned char* dst, size_t size) const;
+
+    size_t uncompressed_size() const { return uncompressed_size_; }
+    size_t points() const { return points_.size(); }
+
+private:
+    struct Point {
+        uint64_t out;       // uncompressed offset
+        uint64_t in;        // compressed offset of the first full byte
+        int32_t bits;       // bits of the byte before `in` still to inflate, 0-7
+        uint32_t reserved;
+    };
+
+    bool load(const std::string& index_path, long long mtime, long long size);
+    void build();
+    bool save(const std::string& index_path, long long mtime, long long size) const;
+
+    std::string path_;
+    size_t span_;
+    bool compressed_ = true;
+    size_t uncompressed_size_ = 0;
+    std::vector<Point> points_;
+    std::vector<unsigned char> windows_;    // 32 KB per point
+};
+
+#endif
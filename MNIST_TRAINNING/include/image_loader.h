@@ -0,0 +1,21 @@
+#ifndef IMAGE_LOADER_H
+#define IMAGE_LOADER_H
+
+#include <string>
+#include <vector>
+
+// Prepares an image the way MNIST's were: strokes as light ink on black
+// (images with a light border are inverted, transparency counts as the
+// background), cropped to their bounding box, area-averaged so the longer
+// side is 20 pixels, then placed in the 28x28 output with their center of
+// mass at the center, scaled to [0, 1]. `pixels` is width x height with 1-4
+// interleaved channels (gray, gray+alpha, RGB, RGBA). An image with no ink
+// gives all zeros.
+void mnist_preprocess(const unsigned char* pixels, int width, int height, int channels, float* output);
+
+// Decodes an image file (any format stb_image reads) through mnist_preprocess.
+// Safe to call from several threads at once.
+// Throws std::runtime_error when the file cannot be decoded.
+std::vector<float> load_image(const std::string& filename);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef INFERENCE_CLIENT_H
+#define INFERENCE_CLIENT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Wire format of mnist_server over a Unix stream socket, in host byte
+// order since both ends share the machine. A request is a header then
+// `count` images of Network::input_size floats, preprocessed to [0, 1]; the
+// reply is a header with the same count then count x Network::num_classes
+// probabilities, or a header with a nonzero status and nothing after it.
+// A connection carries any number of requests, one at a time.
+const uint32_t inference_request_magic = 0x51524e4d;   // "MNRQ"
+const uint32_t inference_reply_magic = 0x53524e4d;     // "MNRS"
+const uint32_t max_request_images = 1 << 16;
+
+enum InferenceStatus : int32_t { INFERENCE_OK = 0, INFERENCE_BAD_REQUEST = 1, INFERENCE_FAILED = 2 };
+
+struct InferenceHeader {
+    uint32_t magic;
+    int32_t status;             // InferenceStatus, always INFERENCE_OK in requests
+    uint32_t count;             // images
+    uint32_t reserved;
+};
+
+// Exactly `size` bytes, retrying short transfers and EINTR.
+// False on end of file or error.
+bool read_full(int fd, void* data, size_t size);
+bool write_full(int fd, const void* data, size_t size);
+
+// A connection to mnist_server.
+// Throws std::runtime_error when the server cannot be reached or fails.
+class InferenceClient {
+public:
+    explicit InferenceClient(const std::string& socket_path);
+    ~InferenceClient();
+    InferenceClient(const InferenceClient&) = delete;
+    InferenceClient& operator=(const InferenceClient&) = delete;
+
+    // Same contract as Network::predict, any count up to max_request_images
+    void predict(const float* images, int count, float* probs);
+
+private:
+    std::string path_;
+    int fd_ = -1;
+};
+
+#endif
@@ -1,15 +1,54 @@
 #ifndef KERNELS_H
 #define KERNELS_H
 
-#include <cuda_runtime.h>
-
 extern "C" {
+    // Single-channel valid convolution of one input_width x input_width image,
+    // output_width must be input_width - kernel_size + 1
     void convolution_forward(float* input, float* kernel, float* output,
                            int input_width, int kernel_size, int output_width);
+    // Batched multi-channel convolution, NCHW. input is batch_size x in_channels x
+    // height x width, weights out_channels x in_channels x kernel_size x kernel_size,
+    // bias out_channels (may be null), output batch_size x out_channels x out_h x out_w
+    // with out_h = (height + 2 * padding - kernel_size) / stride + 1, same for out_w.
+    // The algorithm comes from set_conv_algo (backend.h), picked by shape by default.
+    // The Winograd, FFT and channel-blocked (NCHWc) paths cache their transformed
+    // filters per weights buffer; the cache follows sgd_update, copy_to_device and
+    // cuda_free, so weights changed any other way must be reloaded through copy_to_device
+    void conv2d_forward(float* input, float* weights, float* bias, float* output,
+                      int batch_size, int in_channels, int height, int width,
+                      int out_channels, int kernel_size, int stride, int padding);
+    // size covers the whole batch, relu is element-wise
     void relu_activation(float* input, float* output, int size);
-    void softmax(float* input, float* output, int size);
+    // output = pixels * scale + shift, element-wise: widens a batch of 8-bit
+    // images to the floats the first layer reads, after the copy to the device
+    void pixels_to_float(unsigned char* pixels, float* output, float scale, float shift, int size);
+    // input and output are batch_size rows of `size` values, each row normalized on its own;
+    // rows run in parallel and input may alias output
+    void softmax(float* input, float* output, int batch_size, int size);
+    // output (batch_size x output_size) = input (batch_size x input_size) * weights^T + bias,
+    // weights is output_size x input_size
     void fc_forward(float* input, float* weights, float* bias,
-                  float* output, int input_size, int output_size);
+                  float* output, int batch_size, int input_size, int output_size);
+
+    // Gradients of fc_forward given grad_output (batch_size x output_size):
+    // grad_weights = grad_output^T * input, grad_bias = column sums of grad_output,
+    // grad_input = grad_output * weights (skipped when grad_input is null)
+    void fc_backward(float* input, float* weights, float* grad_output,
+                   float* grad_input, float* grad_weights, float* grad_bias,
+                   int batch_size, int input_size, int output_size);
+    // grad_input = grad_output where the relu output is positive, 0 elsewhere; may run in place
+    void relu_backward(float* output, float* grad_output, float* grad_input, int size);
+    // Gradient of the mean cross-entropy wrt the logits: (probs - onehot(labels)) / batch_size
+    void softmax_cross_entropy_backward(float* probs, int* labels, float* grad,
+                                      int batch_size, int num_classes);
+    // Fused, numerically stable log-softmax + NLL over the logits of a batch.
+    // Writes the mean loss of the batch to loss[0], the argmax of every row to
+    // predictions and (probs - onehot(labels)) / batch_size to grad, all in one
+    // pass per row. grad may alias logits; predictions and grad may be null.
+    void softmax_cross_entropy(float* logits, int* labels, float* loss, int* predictions,
+                             float* grad, int batch_size, int num_classes);
+    // params -= learning_rate * grads
+    void sgd_update(float* params, float* grads, float learning_rate, int size);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef MODEL_FILE_H
+#define MODEL_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A named float32 tensor, row-major. When saving `data` points at the
+// values; tensors of a loaded model point into its mapping.
+struct ModelTensor {
+    std::string name;
+    std::vector<int> shape;
+    const float* data = nullptr;
+
+    size_t size() const;
+};
+
+// Model file: a header naming the architecture, a table of tensors (name,
+// dtype, shape, offset), then the tensor data, each tensor aligned to 64
+// bytes so the mapped arrays can be used in place. crc32 checksums cover
+// the header, the table and the data. The file is written to a temporary
+// file then renamed, so a reader never sees half of one.
+// Throws std::runtime_error when the file cannot be written.
+void save_model(const std::string& path, const std::string& architecture,
+                const std::vector<ModelTensor>& tensors);
+
+// A model file mapped read-only; tensors are read in place, nothing is
+// copied. Opening checks the header and table checksums, which costs the
+// same whatever the size of the weights; the data checksum is left to
+// verify(), the one step that reads every byte. Files without the header
+// are taken as the raw dumps written before the format existed: the
+// `legacy` tensors' floats back to back in that order, accepted only when
+// the size matches exactly.
+// Throws std::runtime_error when the file cannot be read, is corrupt or
+// matches neither layout.
+class ModelFile {
+public:
+    explicit ModelFile(const std::string& path, const std::vector<ModelTensor>& legacy = {});
+    ~ModelFile();
+    ModelFile(const ModelFile&) = delete;
+    ModelFile& operator=(const ModelFile&) = delete;
+
+    // Checks the tensor data against its crc32, throws if it does not
+    // match. Legacy dumps have no checksum and always pass.
+    void verify() const;
+
+    // The tensor called `name`, which must have this shape
+    const float* tensor(const std::string& name, const std::vector<int>& shape) const;
+
+    const std::string& architecture() const { return architecture_; }
+    const std::vector<ModelTensor>& tensors() const { return tensors_; }
+    int version() const { return version_; }     // 0 for a legacy raw dump
+
+private:
+    std::string path_;
+    std::string architecture_;
+    std::vector<ModelTensor> tensors_;
+    int version_ = 0;
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    size_t data_start_ = 0;
+    uint32_t data_crc_ = 0;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <memory>
+#include <string>
+
+class ModelFile;
+
+// The trained fc-relu-fc classifier on the active backend, for inference:
+// the model's parameters plus activations for up to max_batch images,
+// allocated once however many images go through it. Host backends use the
+// parameters in place in the mapped model file, only a device backend
+// copies them over. `verify` checks the file's data checksum first (see
+// ModelFile::verify), a pass over every byte. Not thread-safe; one thread
+// runs predict.
+// Throws std::runtime_error when the model file cannot be loaded or does
+// not have this architecture.
+class Network {
+public:
+    static constexpr int input_size = 28 * 28;
+    static constexpr int hidden_size = 128;
+    static constexpr int num_classes = 10;
+
+    Network(const std::string& model_path, int max_batch, bool verify = false);
+    ~Network();
+    Network(const Network&) = delete;
+    Network& operator=(const Network&) = delete;
+
+    // Class probabilities of `count` <= max_batch images (count x input_size,
+    // preprocessed to [0, 1]) into probs, count x num_classes
+    void predict(const float* images, int count, float* probs);
+
+    int max_batch() const { return max_batch_; }
+
+private:
+    std::unique_ptr<ModelFile> model_;
+    bool device_params_;        // the parameters below are device copies to free
+    int max_batch_;
+    float *input_, *hidden_, *output_;
+    float *fc1_weights_, *fc1_bias_, *fc2_weights_, *fc2_bias_;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "augment.h"
+
+// splitmix64: a counter-based generator, the n-th value is a pure function
+// of (state, n), which keeps per-pixel noise independent of loop order
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Uniform in [-1, 1) from the top 24 bits
+static float symmetric_unit(uint64_t bits) {
+    return (float)(bits >> 40) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+uint64_t augment_seed(uint64_t seed, int epoch, int index) {
+    return splitmix64(splitmix64(seed ^ splitmix64((uint64_t)(uint32_t)epoch)) + (uint64_t)(uint32_t)index);
+}
+
+// 32-bit integer hash (lowbias32): multiplies and shifts on 32-bit lanes,
+// which the compiler vectorizes where splitmix64's 64-bit products are not
+static uint32_t hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+void augment_image(const unsigned char* src, unsigned char* dst, int rows, int cols,
+                   const AugmentConfig& config, uint64_t image_seed) {
+    // Buffers reused across the images a thread augments
+    thread_local std::vector<float> padded, grid, grid_row, col_frac, sample_x, sample_y, values;
+    thread_local std::vector<int> col_cell;
+    uint64_t counter = image_seed;
+    auto next_unit = [&] { return symmetric_unit(splitmix64(counter++)); };
+
+    // Source with a one-pixel black border: every sample position is
+    // clamped into it, so the sampling loop needs no bounds tests
+    int pw = cols + 2;
+    padded.assign((size_t)(rows + 2) * pw, 0.0f);
+    for (int y = 0; y < rows; ++y)
+        for (int x = 0; x < cols; ++x)
+            padded[(long)(y + 1) * pw + x + 1] = src[(long)y * cols + x];
+
+    // Output pixel p samples the source at R^-1 (p - c - t) + c
+    float shift_x = next_unit() * config.max_shift;
+    float shift_y = next_unit() * config.max_shift;
+    float angle = next_unit() * config.max_rotation * (float)M_PI / 180.0f;
+    float c = cosf(angle), s = sinf(angle);
+    float cx = (cols - 1) * 0.5f, cy = (rows - 1) * 0.5f;
+
+    // Elastic field: x and y displacements drawn at control points
+    // elastic_spacing pixels apart and bilinearly interpolated in between, a
+    // smooth random field for a few dozen draws. The control points cover
+    // the image with one to spare for the interpolation.
+    bool elastic = config.elastic_amplitude > 0.0f && config.elastic_spacing > 0.0f;
+    int grid_cols = 0;
+    size_t points = 0;
+    float inv = 0.0f;
+    if (elastic) {
+        inv = 1.0f / config.elastic_spacing;
+        int grid_rows = (int)((rows - 1) * inv) + 2;
+        grid_cols = (int)((cols - 1) * inv) + 2;
+        points = (size_t)grid_rows * grid_cols;
+        grid.resize(2 * points);
+        for (float& g : grid)
+            g = next_unit() * config.elastic_amplitude;
+        grid_row.resize(2 * grid_cols);
+        col_cell.resize(cols);
+        col_frac.resize(cols);
+        for (int x = 0; x < cols; ++x) {
+            col_cell[x] = (int)(x * inv);
+            col_frac[x] = x * inv - col_cell[x];
+        }
+    }
+
+    sample_x.resize(cols);
+    sample_y.resize(cols);
+    values.resize(cols);
+    uint32_t noise_base = (uint32_t)splitmix64(counter++);
+    float noise_scale = config.noise * (2.0f / 16777216.0f);
+    for (int y = 0; y < rows; ++y) {
+        // Positions of the row, straight-line arithmetic the compiler vectorizes
+        float dy = y - cy - shift_y;
+        for (int x = 0; x < cols; ++x) {
+            float dx = x - cx - shift_x;
+            sample_x[x] = c * dx + s * dy + cx + 1.0f;
+            sample_y[x] = -s * dx + c * dy + cy + 1.0f;
+        }
+        if (elastic) {
+            // The field interpolated along y once for the row, then along x.
+            // Cells come from y * inv as the grid was sized, a true division
+            // can round up to a last row past the grid.
+            float gy = y * inv;
+            int y0 = (int)gy;
+            float fy = gy - y0;
+            for (int field = 0; field < 2; ++field) {
+                const float* g0 = grid.data() + field * points + (long)y0 * grid_cols;
+                const float* g1 = g0 + grid_cols;
+                float* r = grid_row.data() + field * grid_cols;
+                for (int i = 0; i < grid_cols; ++i)
+                    r[i] = g0[i] + (g1[i] - g0[i]) * fy;
+            }
+            const float* rx = grid_row.data();
+            const float* ry = rx + grid_cols;
+            for (int x = 0; x < cols; ++x) {
+                int i = col_cell[x];
+                float f = col_frac[x];
+                sample_x[x] += rx[i] + (rx[i + 1] - rx[i]) * f;
+                sample_y[x] += ry[i] + (ry[i + 1] - ry[i]) * f;
+            }
+        }
+        // Into padded coordinates, clamped to the black border, and sampled
+        for (int x = 0; x < cols; ++x) {
+            float px = std::min(std::max(sample_x[x], 0.0f), (float)(cols + 1));
+            float py = std::min(std::max(sample_y[x], 0.0f), (float)(rows + 1));
+            int x0 = std::min((int)px, cols);
+            int y0 = std::min((int)py, rows);
+            float fx = px - x0, fy = py - y0;
+            const float* p = padded.data() + (long)y0 * pw + x0;
+            float top = p[0] + (p[1] - p[0]) * fx;
+            float bottom = p[pw] + (p[pw + 1] - p[pw]) * fx;
+            values[x] = top + (bottom - top) * fy;
+        }
+        // Noise in its own pass over the row, plain integer and float lanes
+        // (zero noise adds zero rather than branching)
+        unsigned char* out = dst + (long)y * cols;
+        for (int x = 0; x < cols; ++x) {
+            float noise = (float)(hash32(noise_base + (uint32_t)(y * cols + x)) >> 8) * noise_scale - config.noise;
+            out[x] = (unsigned char)std::min(std::max(values[x] + noise + 0.5f, 0.0f), 255.0f);
+        }
+    }
+}
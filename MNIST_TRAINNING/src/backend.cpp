@@ -0,0 +1,213 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include "backend.h"
+#include "kernels.h"
+#include "memory.h"
+
+// Defined by convolution.cu, absent from the CPU-only build
+extern "C" const Backend* cuda_backend() __attribute__((weak));
+
+static std::vector<const Backend*>& registry() {
+    static std::vector<const Backend*> backends = [] {
+        std::vector<const Backend*> list;
+        if (cuda_backend)
+            list.push_back(cuda_backend());
+        list.push_back(avx512_backend());
+        list.push_back(avx2_backend());
+        list.push_back(scalar_backend());
+        return list;
+    }();
+    return backends;
+}
+
+static const Backend* current = nullptr;
+static std::once_flag chosen;
+static conv_algo conv_choice = CONV_AUTO;
+
+static void choose_default() {
+    const char* wanted = getenv("NN_BACKEND");
+    if (wanted && *wanted) {
+        const Backend* b = find_backend(wanted);
+        if (b && b->available()) {
+            current = b;
+            return;
+        }
+        fprintf(stderr, "Warning: backend '%s' is %s, picking one automatically\n",
+                wanted, b ? "not available on this machine" : "unknown");
+    }
+    for (const Backend* b : registry()) {
+        if (b->available()) {
+            current = b;
+            return;
+        }
+    }
+}
+
+void register_backend(const Backend* backend) {
+    // New backends go in front of the scalar reference, which stays the last resort
+    std::vector<const Backend*>& list = registry();
+    list.insert(list.end() - 1, backend);
+}
+
+int backend_count() {
+    return static_cast<int>(registry().size());
+}
+
+const Backend* backend_at(int index) {
+    return registry().at(index);
+}
+
+const Backend* find_backend(const char* name) {
+    for (const Backend* b : registry())
+        if (strcmp(b->name, name) == 0)
+            return b;
+    return nullptr;
+}
+
+const Backend* active_backend() {
+    std::call_once(chosen, choose_default);
+    return current;
+}
+
+bool select_backend(const char* name) {
+    std::call_once(chosen, choose_default);
+    const Backend* b = find_backend(name);
+    if (!b || !b->available())
+        return false;
+    current = b;
+    return true;
+}
+
+void print_backend(const Backend* b) {
+    fprintf(stderr, "Backend: %s (%s), %d-wide%s, %d thread%s%s\n", b->name, b->description,
+                    b->caps.vector_width, b->caps.fma ? " FMA" : "", b->caps.max_threads,
+                    b->caps.max_threads == 1 ? "" : "s", b->caps.device_memory ? ", device memory" : "");
+}
+
+void set_conv_algo(conv_algo algo) {
+    conv_choice = algo;
+}
+
+conv_algo get_conv_algo() {
+    return conv_choice;
+}
+
+const char* conv_algo_name(conv_algo algo) {
+    static const char* names[] = {"auto", "direct", "im2col", "winograd", "fft", "nchwc"};
+    return algo >= CONV_AUTO && algo <= CONV_NCHWC ? names[algo] : "unknown";
+}
+
+struct CachedFilters {
+    const void* owner;
+    const float* weights;
+    size_t bytes;
+    FilterKey key;
+    FilterData data;
+};
+
+static std::mutex filter_cache_lock;
+static std::vector<CachedFilters> filter_cache;
+
+FilterData filter_cache_find(const void* owner, const float* weights, const FilterKey& key) {
+    std::lock_guard<std::mutex> guard(filter_cache_lock);
+    for (const CachedFilters& f : filter_cache)
+        if (f.owner == owner && f.weights == weights && f.key == key)
+            return f.data;
+    return nullptr;
+}
+
+FilterData filter_cache_insert(const void* owner, const float* weights, size_t bytes, const FilterKey& key,
+                               FilterData data) {
+    std::lock_guard<std::mutex> guard(filter_cache_lock);
+    for (const CachedFilters& f : filter_cache)
+        if (f.owner == owner && f.weights == weights && f.key == key)
+            return f.data;
+    filter_cache.push_back({owner, weights, bytes, key, data});
+    return data;
+}
+
+void filter_cache_forget(const void* begin, size_t bytes) {
+    std::lock_guard<std::mutex> guard(filter_cache_lock);
+    const char* lo = static_cast<const char*>(begin);
+    for (size_t i = filter_cache.size(); i-- > 0;) {
+        const char* w = reinterpret_cast<const char*>(filter_cache[i].weights);
+        if (lo < w + filter_cache[i].bytes && w < lo + bytes)
+            filter_cache.erase(filter_cache.begin() + i);
+    }
+}
+
+// The C API of kernels.h and memory.h forwards to the active backend
+extern "C" {
+    void convolution_forward(float* input, float* kernel, float* output,
+                             int input_width, int kernel_size, int output_width) {
+        active_backend()->convolution_forward(input, kernel, output, input_width, kernel_size, output_width);
+    }
+
+    void conv2d_forward(float* input, float* weights, float* bias, float* output,
+                        int batch_size, int in_channels, int height, int width,
+                        int out_channels, int kernel_size, int stride, int padding) {
+        active_backend()->conv2d_forward(input, weights, bias, output, batch_size, in_channels,
+                                         height, width, out_channels, kernel_size, stride, padding, conv_choice);
+    }
+
+    void relu_activation(float* input, float* output, int size) {
+        active_backend()->relu_activation(input, output, size);
+    }
+
+    void pixels_to_float(unsigned char* pixels, float* output, float scale, float shift, int size) {
+        active_backend()->pixels_to_float(pixels, output, scale, shift, size);
+    }
+
+    void softmax(float* input, float* output, int batch_size, int size) {
+        active_backend()->softmax(input, output, batch_size, size);
+    }
+
+    void fc_forward(float* input, float* weights, float* bias,
+                    float* output, int batch_size, int input_size, int output_size) {
+        active_backend()->fc_forward(input, weights, bias, output, batch_size, input_size, output_size);
+    }
+
+    void fc_backward(float* input, float* weights, float* grad_output,
+                     float* grad_input, float* grad_weights, float* grad_bias,
+                     int batch_size, int input_size, int output_size) {
+        active_backend()->fc_backward(input, weights, grad_output, grad_input, grad_weights, grad_bias,
+                                      batch_size, input_size, output_size);
+    }
+
+    void relu_backward(float* output, float* grad_output, float* grad_input, int size) {
+        active_backend()->relu_backward(output, grad_output, grad_input, size);
+    }
+
+    void softmax_cross_entropy_backward(float* probs, int* labels, float* grad,
+                                        int batch_size, int num_classes) {
+        active_backend()->softmax_cross_entropy_backward(probs, labels, grad, batch_size, num_classes);
+    }
+
+    void softmax_cross_entropy(float* logits, int* labels, float* loss, int* predictions,
+                               float* grad, int batch_size, int num_classes) {
+        active_backend()->softmax_cross_entropy(logits, labels, loss, predictions, grad, batch_size, num_classes);
+    }
+
+    void sgd_update(float* params, float* grads, float learning_rate, int size) {
+        active_backend()->sgd_update(params, grads, learning_rate, size);
+    }
+
+    void* cuda_malloc(size_t size) {
+        return active_backend()->device_malloc(size);
+    }
+
+    void cuda_free(void* ptr) {
+        active_backend()->device_free(ptr);
+    }
+
+    void copy_to_device(void* dest, void* src, size_t size) {
+        active_backend()->copy_to_device(dest, src, size);
+    }
+
+    void copy_to_host(void* dest, void* src, size_t size) {
+        active_backend()->copy_to_host(dest, src, size);
+    }
+}
@@ -0,0 +1,42 @@
+// AVX2 + FMA build of the CPU kernels, 8 floats per vector.
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <memory>
+#include <omp.h>
+#include <vector>
+#include "backend.h"
+
+#define CPU_VECTOR_WIDTH 8
+
+// Only the kernels get the ISA; the code below runs on every CPU to ask
+// whether this backend is usable, so it must stay on the baseline target.
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace {
+#include "cpu_kernels.inl"
+}
+#pragma GCC pop_options
+
+static bool avx2_available() {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+extern "C" const Backend* avx2_backend() {
+    static const Backend backend = [] {
+        Backend b = {};
+        b.name = "avx2";
+        b.description = "AVX2 + FMA, 8 floats per vector";
+        b.caps = {CPU_VECTOR_WIDTH, true, false, omp_get_max_threads()};
+        b.available = avx2_available;
+#define SET(fn) b.fn = fn;
+        NN_BACKEND_FUNCTIONS(SET)
+#undef SET
+        return b;
+    }();
+    return &backend;
+}
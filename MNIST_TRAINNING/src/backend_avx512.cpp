@@ -0,0 +1,42 @@
+// AVX-512 build of the CPU kernels, 16 floats per vector.
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <memory>
+#include <omp.h>
+#include <vector>
+#include "backend.h"
+
+#define CPU_VECTOR_WIDTH 16
+
+// Kernels only, as in backend_avx2.cpp
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512vl,avx512dq,avx512bw,fma,prefer-vector-width=512")
+namespace {
+#include "cpu_kernels.inl"
+}
+#pragma GCC pop_options
+
+static bool avx512_available() {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+        && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw");
+}
+
+extern "C" const Backend* avx512_backend() {
+    static const Backend backend = [] {
+        Backend b = {};
+        b.name = "avx512";
+        b.description = "AVX-512, 16 floats per vector";
+        b.caps = {CPU_VECTOR_WIDTH, true, false, omp_get_max_threads()};
+        b.available = avx512_available;
+#define SET(fn) b.fn = fn;
+        NN_BACKEND_FUNCTIONS(SET)
+#undef SET
+        return b;
+    }();
+    return &backend;
+}
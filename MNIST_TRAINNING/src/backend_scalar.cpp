@@ -0,0 +1,42 @@
+// Scalar reference build of the CPU kernels: no SIMD, only OpenMP threads.
+// Every other backend is checked against it.
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <memory>
+#include <omp.h>
+#include <vector>
+#include "backend.h"
+
+#define CPU_VECTOR_WIDTH 1
+
+#pragma GCC push_options
+#pragma GCC optimize("no-tree-vectorize")
+#define CPU_SCALAR
+namespace {
+#include "cpu_kernels.inl"
+}
+#pragma GCC pop_options
+
+static bool scalar_available() {
+    return true;
+}
+
+extern "C" const Backend* scalar_backend() {
+    static const Backend backend = [] {
+        Backend b = {};
+        b.name = "scalar";
+        b.description = "Portable scalar reference";
+        b.caps = {CPU_VECTOR_WIDTH, false, false, omp_get_max_threads()};
+        b.available = scalar_available;
+#define SET(fn) b.fn = fn;
+        NN_BACKEND_FUNCTIONS(SET)
+#undef SET
+        return b;
+    }();
+    return &backend;
+}
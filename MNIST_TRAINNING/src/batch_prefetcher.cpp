@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include "batch_prefetcher.h"
+
+// aligned_alloc wants a multiple of the alignment
+static void* alloc_aligned(size_t size) {
+    void* ptr = aligned_alloc(64, (size + 63) / 64 * 64);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+BatchPrefetcher::BatchPrefetcher(const MnistDataset& data, int batch_size, int epochs, unsigned seed, int depth,
+                                 int workers, const AugmentConfig* augment)
+    : data_(data), batch_size_(batch_size), epochs_(epochs), seed_(seed), num_images_(data.num_images),
+      image_size_((size_t)data.rows * data.cols), augmenting_(augment != nullptr),
+      augment_(augment ? *augment : AugmentConfig()) {
+    if (batch_size <= 0 || depth <= 0 || workers <= 0)
+        throw std::invalid_argument("BatchPrefetcher: batch_size, depth and workers must be positive");
+    for (int i = 0; i <= depth; ++i) {
+        Batch b;
+        b.pixels = static_cast<unsigned char*>(alloc_aligned(batch_size * image_size_));
+        b.labels = static_cast<int*>(alloc_aligned(batch_size * sizeof(int)));
+        b.size = 0;
+        b.epoch = 0;
+        slots_.push_back(b);
+        free_.push_back(i);
+    }
+    for (int i = 0; i < workers; ++i)
+        workers_.emplace_back(&BatchPrefetcher::produce, this);
+}
+
+BatchPrefetcher::~BatchPrefetcher() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stop_ = true;
+    }
+    slot_freed_.notify_all();
+    for (std::thread& t : workers_)
+        t.join();
+    for (Batch& b : slots_) {
+        free(b.pixels);
+        free(b.labels);
+    }
+}
+
+void BatchPrefetcher::produce() {
+    long total = (long)epochs_ * batches();
+    // This worker's copy of the permutation of the epoch it last worked on
+    std::vector<int> order;
+    int order_epoch = -1;
+    for (;;) {
+        int slot;
+        long sequence;
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            slot_freed_.wait(guard, [&] { return stop_ || claimed_ == total || !free_.empty(); });
+            if (stop_ || claimed_ == total) return;
+            slot = free_.back();
+            free_.pop_back();
+            sequence = claimed_++;
+        }
+        // The gather runs unlocked, the slot belongs to this worker now
+        fill(slots_[slot], sequence, order, order_epoch);
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            ready_[sequence] = slot;
+        }
+        batch_ready_.notify_all();
+    }
+}
+
+void BatchPrefetcher::fill(Batch& b, long sequence, std::vector<int>& order, int& order_epoch) {
+    int epoch = (int)(sequence / batches());
+    int first = (int)(sequence % batches()) * batch_size_;
+    if (order_epoch != epoch) {
+        order.resize(num_images_);
+        std::iota(order.begin(), order.end(), 0);
+        // Index -1 keeps the permutation's stream apart from every image's
+        std::mt19937 rng((uint32_t)augment_seed(seed_, epoch, -1));
+        std::shuffle(order.begin(), order.end(), rng);
+        order_epoch = epoch;
+    }
+
+    b.size = std::min(batch_size_, num_images_ - first);
+    b.epoch = epoch;
+    const unsigned char* pixels = data_.images.data;
+    for (int j = 0; j < b.size; ++j) {
+        int index = order[first + j];
+        const unsigned char* src = pixels + (size_t)index * image_size_;
+        unsigned char* dst = b.pixels + j * image_size_;
+        if (augmenting_)
+            augment_image(src, dst, data_.rows, data_.cols, augment_, augment_seed(seed_, epoch, index));
+        else
+            memcpy(dst, src, image_size_);
+        b.labels[j] = data_.labels[index];
+    }
+}
+
+const Batch* BatchPrefetcher::next() {
+    std::unique_lock<std::mutex> guard(lock_);
+    if (held_ >= 0) {
+        free_.push_back(held_);
+        held_ = -1;
+        slot_freed_.notify_one();
+    }
+    if (consumed_ == (long)epochs_ * batches()) return nullptr;
+    batch_ready_.wait(guard, [&] { return ready_.count(consumed_) != 0; });
+    auto it = ready_.find(consumed_++);
+    held_ = it->second;
+    ready_.erase(it);
+    return &slots_[held_];
+}
@@ -0,0 +1,242 @@
+// Times the kernels on every backend available on this machine and checks
+// their results, and those of every conv2d algorithm, against the scalar
+// reference. Exits 1 when a result is off by more than `tolerance`.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "backend.h"
+#include "kernels.h"
+#include "memory.h"
+
+const int input_size = 28 * 28;
+const int hidden_size = 128;
+const int num_classes = 10;
+const int kernel_size = 5;
+const int conv_width = 28 - kernel_size + 1;
+const int batch_size = 100;
+const int wide_classes = 10000;
+const float tolerance = 1e-4f;
+static int iterations = 2000;     // --iterations, `make check` runs a few
+
+// conv2d_forward layers, each timed with every algorithm that can run it
+struct ConvLayer {
+    int batch, in_channels, out_channels, width, kernel_size, padding;
+};
+const ConvLayer conv_layers[] = {
+    {32, 16, 32, 14, 3, 1},     // 3x3 same-padded
+    {8, 8, 16, 54, 11, 5},     // large kernel, FFT territory
+    {1, 16, 32, 28, 5, 2},     // single-image inference
+};
+const int conv_layer_count = sizeof(conv_layers) / sizeof(conv_layers[0]);
+
+struct Result {
+    std::vector<float> hidden;
+    std::vector<float> output;
+    std::vector<float> conv;
+    std::vector<float> batch;
+    std::vector<float> wide;
+    // conv2d output of each layer per algorithm, empty where it cannot run
+    std::vector<float> layers[conv_layer_count][CONV_NCHWC + 1];
+};
+
+template <typename F>
+static double time_us(F f, int count = iterations) {
+    count = std::max(1, count);
+    // Untimed first call: it fills the filter caches and workspaces
+    f();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i)
+        f();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+static float max_diff(const std::vector<float>& a, const std::vector<float>& b) {
+    float d = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i)
+        d = fmaxf(d, fabsf(a[i] - b[i]));
+    return d;
+}
+
+static Result run(const std::vector<float>& image, const std::vector<float>& weights,
+                  const std::vector<float>& bias, const std::vector<float>& kernel,
+                  const std::vector<float>& logits, const std::vector<float>* maps,
+                  const std::vector<float>* filters) {
+    float* d_input = static_cast<float*>(cuda_malloc(input_size * sizeof(float)));
+    float* d_weights = static_cast<float*>(cuda_malloc(weights.size() * sizeof(float)));
+    float* d_bias = static_cast<float*>(cuda_malloc(bias.size() * sizeof(float)));
+    float* d_kernel = static_cast<float*>(cuda_malloc(kernel.size() * sizeof(float)));
+    float* d_hidden = static_cast<float*>(cuda_malloc(hidden_size * sizeof(float)));
+    float* d_output = static_cast<float*>(cuda_malloc(num_classes * sizeof(float)));
+    float* d_conv = static_cast<float*>(cuda_malloc(conv_width * conv_width * sizeof(float)));
+    float* d_batch_in = static_cast<float*>(cuda_malloc(batch_size * input_size * sizeof(float)));
+    float* d_batch_out = static_cast<float*>(cuda_malloc(batch_size * hidden_size * sizeof(float)));
+    float* d_logits = static_cast<float*>(cuda_malloc(logits.size() * sizeof(float)));
+    float* d_probs = static_cast<float*>(cuda_malloc(logits.size() * sizeof(float)));
+
+    copy_to_device(d_input, (void*)image.data(), image.size() * sizeof(float));
+    copy_to_device(d_weights, (void*)weights.data(), weights.size() * sizeof(float));
+    copy_to_device(d_bias, (void*)bias.data(), bias.size() * sizeof(float));
+    copy_to_device(d_kernel, (void*)kernel.data(), kernel.size() * sizeof(float));
+    copy_to_device(d_logits, (void*)logits.data(), logits.size() * sizeof(float));
+    for (int b = 0; b < batch_size; ++b)
+        copy_to_device(d_batch_in + b * input_size, (void*)image.data(), image.size() * sizeof(float));
+
+    double fc = time_us([&] { fc_forward(d_input, d_weights, d_bias, d_hidden, 1, input_size, hidden_size); });
+    double relu = time_us([&] { relu_activation(d_hidden, d_hidden, hidden_size); });
+    double sm = time_us([&] { softmax(d_hidden, d_output, 1, num_classes); });
+    double batch = time_us([&] { fc_forward(d_batch_in, d_weights, d_bias, d_batch_out, batch_size, input_size, hidden_size); });
+    double wide = time_us([&] { softmax(d_logits, d_probs, batch_size, wide_classes); }, iterations / 40);
+    double conv = time_us([&] { convolution_forward(d_input, d_kernel, d_conv, 28, kernel_size, conv_width); });
+
+    Result r;
+    r.hidden.resize(hidden_size);
+    r.output.resize(num_classes);
+    r.conv.resize(conv_width * conv_width);
+    fc_forward(d_input, d_weights, d_bias, d_hidden, 1, input_size, hidden_size);
+    copy_to_host(r.hidden.data(), d_hidden, hidden_size * sizeof(float));
+    softmax(d_hidden, d_output, 1, num_classes);
+    copy_to_host(r.output.data(), d_output, num_classes * sizeof(float));
+    copy_to_host(r.conv.data(), d_conv, r.conv.size() * sizeof(float));
+    r.batch.resize(batch_size * hidden_size);
+    copy_to_host(r.batch.data(), d_batch_out, r.batch.size() * sizeof(float));
+    r.wide.resize(logits.size());
+    copy_to_host(r.wide.data(), d_probs, r.wide.size() * sizeof(float));
+    printf("  fc %8.2f us  fc x%d %8.2f us (%.1f GFLOP/s)  relu %6.2f us  softmax %6.2f us  conv %7.2f us\n",
+           fc, batch_size, batch, 2.0 * batch_size * input_size * hidden_size / batch / 1e3, relu, sm, conv);
+    printf("  softmax %dx%d %8.2f us (%.2f Gelem/s)\n",
+           batch_size, wide_classes, wide, logits.size() / wide / 1e3);
+
+    for (int l = 0; l < conv_layer_count; ++l) {
+        const ConvLayer& c = conv_layers[l];
+        int out_width = c.width + 2 * c.padding - c.kernel_size + 1;
+        size_t out_size = (size_t)c.batch * c.out_channels * out_width * out_width;
+        double flops = 2.0 * out_size * c.in_channels * c.kernel_size * c.kernel_size;
+        float* d_maps = static_cast<float*>(cuda_malloc(maps[l].size() * sizeof(float)));
+        float* d_filters = static_cast<float*>(cuda_malloc(filters[l].size() * sizeof(float)));
+        float* d_layer = static_cast<float*>(cuda_malloc(out_size * sizeof(float)));
+        copy_to_device(d_maps, (void*)maps[l].data(), maps[l].size() * sizeof(float));
+        copy_to_device(d_filters, (void*)filters[l].data(), filters[l].size() * sizeof(float));
+
+        printf("  conv2d %dx%d->%d %dx%d %dx%d:", c.batch, c.in_channels, c.out_channels,
+               c.width, c.width, c.kernel_size, c.kernel_size);
+        for (int a = CONV_AUTO; a <= CONV_NCHWC; ++a) {
+            if ((a == CONV_DIRECT && c.padding != 0) || (a == CONV_WINOGRAD && c.kernel_size != 3))
+                continue;
+            set_conv_algo((conv_algo)a);
+            double t = time_us([&] {
+                conv2d_forward(d_maps, d_filters, d_bias, d_layer, c.batch, c.in_channels, c.width, c.width,
+                               c.out_channels, c.kernel_size, 1, c.padding);
+            }, iterations / 200);
+            printf("  %s %.0f us (%.1f GFLOP/s)", conv_algo_name((conv_algo)a), t, flops / t / 1e3);
+            r.layers[l][a].resize(out_size);
+            copy_to_host(r.layers[l][a].data(), d_layer, out_size * sizeof(float));
+        }
+        printf("\n");
+        set_conv_algo(CONV_AUTO);
+        cuda_free(d_maps);
+        cuda_free(d_filters);
+        cuda_free(d_layer);
+    }
+
+    cuda_free(d_input);
+    cuda_free(d_weights);
+    cuda_free(d_bias);
+    cuda_free(d_kernel);
+    cuda_free(d_hidden);
+    cuda_free(d_output);
+    cuda_free(d_conv);
+    cuda_free(d_batch_in);
+    cuda_free(d_batch_out);
+    cuda_free(d_logits);
+    cuda_free(d_probs);
+    return r;
+}
+
+// Prints `name diff`, flagging it when over tolerance. False if it is.
+static bool check(const char* name, float diff) {
+    bool ok = diff <= tolerance;
+    printf("  %s %g%s", name, diff, ok ? "" : " (FAIL)");
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "Usage: %s [--iterations N]\n", argv[0]);
+            return 1;
+        }
+    }
+    std::vector<float> image(input_size), weights(input_size * hidden_size), bias(hidden_size);
+    std::vector<float> kernel(kernel_size * kernel_size);
+    for (float& v : image) v = rand() / (float)RAND_MAX;
+    for (float& v : weights) v = (rand() / (float)RAND_MAX - 0.5f) * 0.1f;
+    for (float& v : bias) v = rand() / (float)RAND_MAX * 0.1f;
+    for (float& v : kernel) v = rand() / (float)RAND_MAX;
+    std::vector<float> logits(batch_size * wide_classes);
+    for (float& v : logits) v = (rand() / (float)RAND_MAX - 0.5f) * 40.0f;
+    std::vector<float> maps[conv_layer_count], filters[conv_layer_count];
+    for (int l = 0; l < conv_layer_count; ++l) {
+        const ConvLayer& c = conv_layers[l];
+        maps[l].resize((size_t)c.batch * c.in_channels * c.width * c.width);
+        filters[l].resize((size_t)c.out_channels * c.in_channels * c.kernel_size * c.kernel_size);
+        for (float& v : maps[l]) v = rand() / (float)RAND_MAX;
+        for (float& v : filters[l]) v = (rand() / (float)RAND_MAX - 0.5f) * 0.2f;
+    }
+
+    Result reference;
+    bool have_reference = false;
+    int failures = 0;
+    // Reference first so every other backend can be compared to it
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < backend_count(); ++i) {
+            const Backend* b = backend_at(i);
+            bool is_reference = b == scalar_backend();
+            if (is_reference != (pass == 0))
+                continue;
+            if (!b->available()) {
+                fprintf(stderr, "Backend: %s (not available)\n", b->name);
+                continue;
+            }
+            select_backend(b->name);
+            // The banner is on stderr, keep it ahead of this backend's timings
+            fflush(stdout);
+            print_backend(b);
+            Result r = run(image, weights, bias, kernel, logits, maps, filters);
+            if (!have_reference) {
+                reference = r;
+                have_reference = true;
+            }
+            // Every conv2d algorithm, the scalar backend's included, against
+            // the scalar backend's automatic choice
+            printf("  max diff vs scalar:");
+            if (!is_reference) {
+                failures += !check("fc", max_diff(r.hidden, reference.hidden));
+                failures += !check("fc batch", max_diff(r.batch, reference.batch));
+                failures += !check("softmax", max_diff(r.output, reference.output));
+                failures += !check("softmax wide", max_diff(r.wide, reference.wide));
+                failures += !check("conv", max_diff(r.conv, reference.conv));
+            }
+            for (int l = 0; l < conv_layer_count; ++l) {
+                printf("\n   conv2d layer %d:", l);
+                for (int a = CONV_AUTO; a <= CONV_NCHWC; ++a) {
+                    if (!r.layers[l][a].empty())
+                        failures += !check(conv_algo_name((conv_algo)a),
+                                           max_diff(r.layers[l][a], reference.layers[l][CONV_AUTO]));
+                }
+            }
+            printf("\n");
+        }
+    }
+    if (failures) {
+        fprintf(stderr, "%d result%s differ from the scalar reference by more than %g\n", failures,
+                failures == 1 ? "" : "s", tolerance);
+        return 1;
+    }
+    return 0;
+}
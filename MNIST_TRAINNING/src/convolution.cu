@@ -1,7 +1,7 @@
 #include <cuda_runtime.h>
 #include <math.h>
 #include <stdio.h>
-#include "kernels.h"
+#include "backend.h"
 
 #define CUDA_CHECK(call) \
     do { \
@@ -12,23 +12,35 @@
         } \
     } while(0)
 
-__global__ void convolution_kernel(const float* input, const float* kernel, float* output,
-                                 int input_width, int kernel_size, int output_width) {
-    int row = blockIdx.y * blockDim.y + threadIdx.y;
-    int col = blockIdx.x * blockDim.x + threadIdx.x;
+// Direct convolution, one thread per output value (NCHW), the reference
+// the CPU im2col + GEMM path is checked against
+__global__ void conv2d_kernel(const float* input, const float* weights, const float* bias, float* output,
+                              int batch_size, int in_channels, int height, int width,
+                              int out_channels, int kernel_size, int stride, int padding,
+                              int out_h, int out_w) {
+    long idx = (long)blockIdx.x * blockDim.x + threadIdx.x;
+    long total = (long)batch_size * out_channels * out_h * out_w;
+    if (idx >= total) return;
+    int ox = idx % out_w;
+    int oy = idx / out_w % out_h;
+    int o = idx / ((long)out_w * out_h) % out_channels;
+    int b = idx / ((long)out_w * out_h * out_channels);
 
-    if (row < output_width && col < output_width) {
-        float sum = 0.0f;
+    float sum = bias ? bias[o] : 0.0f;
+    for (int c = 0; c < in_channels; ++c) {
+        const float* in = input + ((long)b * in_channels + c) * height * width;
+        const float* w = weights + ((long)o * in_channels + c) * kernel_size * kernel_size;
         for (int i = 0; i < kernel_size; ++i) {
+            int iy = oy * stride - padding + i;
+            if (iy < 0 || iy >= height) continue;
             for (int j = 0; j < kernel_size; ++j) {
-                int input_row = row + i;
-                int input_col = col + j;
-                sum += input[input_row * input_width + input_col] * 
-                      kernel[i * kernel_size + j];
+                int ix = ox * stride - padding + j;
+                if (ix < 0 || ix >= width) continue;
+                sum += in[iy * width + ix] * w[i * kernel_size + j];
             }
         }
-        output[row * output_width + col] = sum;
     }
+    output[idx] = sum;
 }
 
 __global__ void relu_kernel(float* input, float* output, int size) {
@@ -36,52 +48,218 @@ __global__ void relu_kernel(float* input, float* output, int size) {
     if (idx < size) output[idx] = fmaxf(0.0f, input[idx]);
 }
 
-__global__ void softmax_kernel(float* input, float* output, int size) {
-    float max_val = input[0];
-    for (int i = 1; i < size; ++i)
-        max_val = fmaxf(max_val, input[i]);
+__global__ void pixels_to_float_kernel(const unsigned char* pixels, float* output, float scale, float shift, int size) {
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < size) output[idx] = pixels[idx] * scale + shift;
+}
 
-    float sum = 0.0f;
-    for (int i = 0; i < size; ++i)
-        sum += expf(input[i] - max_val);
+// Softmax runs one block per row. Each thread keeps an online max and
+// sum(exp(x - max)) over a strided slice of the row, then the pairs are
+// merged across the warp with shuffles and across warps through shared
+// memory, so a 10k-class row is read by the whole block instead of one thread.
+__device__ void softmax_merge(float& m, float& s, float m2, float s2) {
+    float mx = fmaxf(m, m2);
+    if (mx == -INFINITY) return;
+    s = s * expf(m - mx) + s2 * expf(m2 - mx);
+    m = mx;
+}
+
+__device__ void softmax_block_stats(const float* x, int n, float& max_out, float& sum_out) {
+    __shared__ float warp_m[32], warp_s[32];
+    int lane = threadIdx.x % 32, warp = threadIdx.x / 32;
+    float m = -INFINITY, s = 0.0f;
+
+    for (int i = threadIdx.x; i < n; i += blockDim.x) {
+        float v = x[i];
+        if (v > m) {
+            s = s * expf(m - v) + 1.0f;
+            m = v;
+        } else {
+            s += expf(v - m);
+        }
+    }
+    for (int offset = 16; offset > 0; offset >>= 1)
+        softmax_merge(m, s, __shfl_xor_sync(0xffffffff, m, offset), __shfl_xor_sync(0xffffffff, s, offset));
+    if (lane == 0) {
+        warp_m[warp] = m;
+        warp_s[warp] = s;
+    }
+    __syncthreads();
+    int warps = blockDim.x / 32;
+    m = lane < warps ? warp_m[lane] : -INFINITY;
+    s = lane < warps ? warp_s[lane] : 0.0f;
+    for (int offset = 16; offset > 0; offset >>= 1)
+        softmax_merge(m, s, __shfl_xor_sync(0xffffffff, m, offset), __shfl_xor_sync(0xffffffff, s, offset));
+    // Every thread now holds the row result; the shared slots may be reused
+    __syncthreads();
+    max_out = m;
+    sum_out = s;
+}
 
-    for (int i = 0; i < size; ++i)
-        output[i] = expf(input[i] - max_val) / sum;
+// Block size for one row: a single warp for small heads, more for wide ones
+static int softmax_threads(int size) {
+    return size <= 32 ? 32 : (size <= 2048 ? 128 : 256);
 }
 
+__global__ void softmax_kernel(float* input, float* output, int batch_size, int size) {
+    const float* x = input + (long)blockIdx.x * size;
+    float* y = output + (long)blockIdx.x * size;
+    float max_val, sum;
+    softmax_block_stats(x, size, max_val, sum);
+
+    float inv = 1.0f / sum;
+    for (int i = threadIdx.x; i < size; i += blockDim.x)
+        y[i] = expf(x[i] - max_val) * inv;
+}
+
+#define FC_TILE 16
+
+// Batched fc as a tiled GEMM: each block computes a FC_TILE x FC_TILE tile of
+// output (samples x outputs), staging input rows and weight rows through
+// shared memory so every weight is read once per tile instead of once per sample
 __global__ void fc_kernel(const float* input, const float* weights, const float* bias,
-                        float* output, int input_size, int output_size) {
+                        float* output, int batch_size, int input_size, int output_size) {
+    __shared__ float in_tile[FC_TILE][FC_TILE + 1];
+    __shared__ float w_tile[FC_TILE][FC_TILE + 1];
+    int b = blockIdx.y * FC_TILE + threadIdx.y;
+    int o = blockIdx.x * FC_TILE + threadIdx.x;
+    int w_row = blockIdx.x * FC_TILE + threadIdx.y;
+    float sum = 0.0f;
+
+    for (int t = 0; t < input_size; t += FC_TILE) {
+        int i = t + threadIdx.x;
+        in_tile[threadIdx.y][threadIdx.x] = (b < batch_size && i < input_size) ? input[(long)b * input_size + i] : 0.0f;
+        w_tile[threadIdx.y][threadIdx.x] = (w_row < output_size && i < input_size) ? weights[(long)w_row * input_size + i] : 0.0f;
+        __syncthreads();
+        for (int k = 0; k < FC_TILE; ++k)
+            sum += in_tile[threadIdx.y][k] * w_tile[threadIdx.x][k];
+        __syncthreads();
+    }
+    if (b < batch_size && o < output_size)
+        output[(long)b * output_size + o] = sum + bias[o];
+}
+
+// dW[o][i] = sum_b dY[b][o] * X[b][i], one thread per weight
+__global__ void fc_grad_weights_kernel(const float* input, const float* grad_output, float* grad_weights,
+                                       int batch_size, int input_size, int output_size) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    int o = blockIdx.y;
+    if (i >= input_size) return;
+    float sum = 0.0f;
+    for (int b = 0; b < batch_size; ++b)
+        sum += grad_output[(long)b * output_size + o] * input[(long)b * input_size + i];
+    grad_weights[(long)o * input_size + i] = sum;
+}
+
+__global__ void fc_grad_bias_kernel(const float* grad_output, float* grad_bias, int batch_size, int output_size) {
+    int o = blockIdx.x * blockDim.x + threadIdx.x;
+    if (o >= output_size) return;
+    float sum = 0.0f;
+    for (int b = 0; b < batch_size; ++b)
+        sum += grad_output[(long)b * output_size + o];
+    grad_bias[o] = sum;
+}
+
+// dX[b][i] = sum_o dY[b][o] * W[o][i], one thread per input of one sample
+__global__ void fc_grad_input_kernel(const float* weights, const float* grad_output, float* grad_input,
+                                     int batch_size, int input_size, int output_size) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    int b = blockIdx.y;
+    if (i >= input_size) return;
+    float sum = 0.0f;
+    for (int o = 0; o < output_size; ++o)
+        sum += grad_output[(long)b * output_size + o] * weights[(long)o * input_size + i];
+    grad_input[(long)b * input_size + i] = sum;
+}
+
+__global__ void relu_backward_kernel(const float* output, const float* grad_output, float* grad_input, int size) {
     int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx < output_size) {
-        float sum = 0.0f;
-        for (int i = 0; i < input_size; ++i)
-            sum += input[i] * weights[idx * input_size + i];
-        output[idx] = sum + bias[idx];
+    if (idx < size) grad_input[idx] = output[idx] > 0.0f ? grad_output[idx] : 0.0f;
+}
+
+__global__ void softmax_ce_backward_kernel(const float* probs, const int* labels, float* grad,
+                                           int batch_size, int num_classes) {
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= batch_size * num_classes) return;
+    int b = idx / num_classes;
+    int c = idx % num_classes;
+    grad[idx] = (probs[idx] - (c == labels[b] ? 1.0f : 0.0f)) / batch_size;
+}
+
+// One block per row: stable log-softmax + NLL, argmax and gradient in one go
+__global__ void softmax_ce_kernel(const float* logits, const int* labels, float* loss, int* predictions,
+                                  float* grad, int batch_size, int num_classes) {
+    __shared__ int warp_best[32];
+    int b = blockIdx.x;
+    int lane = threadIdx.x % 32, warp = threadIdx.x / 32;
+    const float* x = logits + (long)b * num_classes;
+    int label = labels[b];
+
+    float max_val, sum;
+    softmax_block_stats(x, num_classes, max_val, sum);
+
+    // First class holding the max, as a sequential argmax would pick
+    int best = num_classes;
+    for (int c = threadIdx.x; c < num_classes && best == num_classes; c += blockDim.x)
+        if (x[c] == max_val)
+            best = c;
+    for (int offset = 16; offset > 0; offset >>= 1)
+        best = min(best, __shfl_xor_sync(0xffffffff, best, offset));
+    if (lane == 0)
+        warp_best[warp] = best;
+    __syncthreads();
+
+    float scale = 1.0f / batch_size;
+    if (threadIdx.x == 0) {
+        for (int w = 1; w < blockDim.x / 32; ++w)
+            best = min(best, warp_best[w]);
+        atomicAdd(loss, (logf(sum) + max_val - x[label]) * scale);
+        if (predictions)
+            predictions[b] = best < num_classes ? best : 0;
+    }
+    if (grad) {
+        // grad may alias logits: every read of the row above must be done
+        __syncthreads();
+        float* g = grad + (long)b * num_classes;
+        float inv = scale / sum;
+        for (int c = threadIdx.x; c < num_classes; c += blockDim.x)
+            g[c] = expf(x[c] - max_val) * inv - (c == label ? scale : 0.0f);
     }
 }
 
-// Wrappers
-extern "C" {
+__global__ void sgd_update_kernel(float* params, const float* grads, float learning_rate, int size) {
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < size) params[idx] -= learning_rate * grads[idx];
+}
+
+// Wrappers, reached through the backend registry (see backend.cpp)
+namespace cuda_impl {
+    void conv2d_forward(float* d_input, float* d_weights, float* d_bias, float* d_output,
+                        int batch_size, int in_channels, int height, int width,
+                        int out_channels, int kernel_size, int stride, int padding, int algo) {
+        // One direct kernel whatever the algorithm asked for
+        int out_h = (height + 2 * padding - kernel_size) / stride + 1;
+        int out_w = (width + 2 * padding - kernel_size) / stride + 1;
+        long total = (long)batch_size * out_channels * out_h * out_w;
+        conv2d_kernel<<<(total + 255) / 256, 256>>>(d_input, d_weights, d_bias, d_output,
+                                                    batch_size, in_channels, height, width,
+                                                    out_channels, kernel_size, stride, padding, out_h, out_w);
+        CUDA_CHECK(cudaGetLastError());
+    }
+
     void convolution_forward(float* d_input, float* d_kernel, float* d_output,
             int input_width, int kernel_size, int output_width) {
         if (!d_input || !d_kernel || !d_output) {
         printf("Error: Null pointer detected!\n");
         return;
         }
-
-        printf("input_width: %d, kernel_size: %d, output_width: %d\n",
-        input_width, kernel_size, output_width);
-
-        dim3 block(16, 16);
-        dim3 grid((output_width + block.x - 1) / block.x,
-        (output_width + block.y - 1) / block.y);
-
-        printf("Grid: (%d, %d), Block: (%d, %d)\n",
-        grid.x, grid.y, block.x, block.y);
-
-        convolution_kernel<<<grid, block>>>(d_input, d_kernel, d_output,
-                            input_width, kernel_size, output_width);
-        CUDA_CHECK(cudaGetLastError());
+        if (output_width != input_width - kernel_size + 1) {
+            printf("Error: output_width %d does not match a valid %dx%d convolution of width %d\n",
+                   output_width, kernel_size, kernel_size, input_width);
+            return;
+        }
+        conv2d_forward(d_input, d_kernel, nullptr, d_output, 1, 1, input_width, input_width,
+                       1, kernel_size, 1, 0, CONV_AUTO);
     }
 
     void relu_activation(float* d_input, float* d_output, int size) {
@@ -91,29 +269,77 @@ extern "C" {
         CUDA_CHECK(cudaGetLastError());
     }
 
-    void softmax(float* d_input, float* d_output, int size) {
-        softmax_kernel<<<1, 1>>>(d_input, d_output, size);
+    void pixels_to_float(unsigned char* d_pixels, float* d_output, float scale, float shift, int size) {
+        pixels_to_float_kernel<<<(size + 255) / 256, 256>>>(d_pixels, d_output, scale, shift, size);
+        CUDA_CHECK(cudaGetLastError());
+    }
+
+    void softmax(float* d_input, float* d_output, int batch_size, int size) {
+        softmax_kernel<<<batch_size, softmax_threads(size)>>>(d_input, d_output, batch_size, size);
         CUDA_CHECK(cudaGetLastError());
     }
 
     void fc_forward(float* d_input, float* d_weights, float* d_bias,
-                  float* d_output, int input_size, int output_size) {
-        dim3 block(256);
-        dim3 grid((output_size + block.x - 1) / block.x);
+                  float* d_output, int batch_size, int input_size, int output_size) {
+        dim3 block(FC_TILE, FC_TILE);
+        dim3 grid((output_size + FC_TILE - 1) / FC_TILE, (batch_size + FC_TILE - 1) / FC_TILE);
         fc_kernel<<<grid, block>>>(d_input, d_weights, d_bias, d_output,
-                                 input_size, output_size);
+                                 batch_size, input_size, output_size);
+        CUDA_CHECK(cudaGetLastError());
+    }
+
+    void fc_backward(float* d_input, float* d_weights, float* d_grad_output,
+                     float* d_grad_input, float* d_grad_weights, float* d_grad_bias,
+                     int batch_size, int input_size, int output_size) {
+        dim3 block(256);
+        dim3 grid_w((input_size + block.x - 1) / block.x, output_size);
+        fc_grad_weights_kernel<<<grid_w, block>>>(d_input, d_grad_output, d_grad_weights,
+                                                  batch_size, input_size, output_size);
+        fc_grad_bias_kernel<<<(output_size + 255) / 256, block>>>(d_grad_output, d_grad_bias,
+                                                                  batch_size, output_size);
+        if (d_grad_input) {
+            dim3 grid_x((input_size + block.x - 1) / block.x, batch_size);
+            fc_grad_input_kernel<<<grid_x, block>>>(d_weights, d_grad_output, d_grad_input,
+                                                    batch_size, input_size, output_size);
+        }
+        CUDA_CHECK(cudaGetLastError());
+    }
+
+    void relu_backward(float* d_output, float* d_grad_output, float* d_grad_input, int size) {
+        relu_backward_kernel<<<(size + 255) / 256, 256>>>(d_output, d_grad_output, d_grad_input, size);
+        CUDA_CHECK(cudaGetLastError());
+    }
+
+    void softmax_cross_entropy_backward(float* d_probs, int* d_labels, float* d_grad,
+                                        int batch_size, int num_classes) {
+        int size = batch_size * num_classes;
+        softmax_ce_backward_kernel<<<(size + 255) / 256, 256>>>(d_probs, d_labels, d_grad,
+                                                                batch_size, num_classes);
+        CUDA_CHECK(cudaGetLastError());
+    }
+
+    void softmax_cross_entropy(float* d_logits, int* d_labels, float* d_loss, int* d_predictions,
+                               float* d_grad, int batch_size, int num_classes) {
+        CUDA_CHECK(cudaMemset(d_loss, 0, sizeof(float)));
+        softmax_ce_kernel<<<batch_size, softmax_threads(num_classes)>>>(d_logits, d_labels, d_loss, d_predictions,
+                                                                         d_grad, batch_size, num_classes);
+        CUDA_CHECK(cudaGetLastError());
+    }
+
+    void sgd_update(float* d_params, float* d_grads, float learning_rate, int size) {
+        sgd_update_kernel<<<(size + 255) / 256, 256>>>(d_params, d_grads, learning_rate, size);
         CUDA_CHECK(cudaGetLastError());
     }
 }
 
-extern "C" {
-    void* cuda_malloc(size_t size) {
+namespace cuda_impl {
+    void* device_malloc(size_t size) {
         void* ptr;
         CUDA_CHECK(cudaMalloc(&ptr, size));
         return ptr;
     }
     
-    void cuda_free(void* ptr) {
+    void device_free(void* ptr) {
         CUDA_CHECK(cudaFree(ptr));
     }
     
@@ -140,3 +366,23 @@ extern "C" {
             CUDA_CHECK(cudaMemcpy(dest, src, size, cudaMemcpyDeviceToHost));
     }
 }
+
+static bool cuda_available() {
+    int count = 0;
+    return cudaGetDeviceCount(&count) == cudaSuccess && count > 0;
+}
+
+extern "C" const Backend* cuda_backend() {
+    static const Backend backend = [] {
+        Backend b = {};
+        b.name = "cuda";
+        b.description = "Nvidia GPU through the CUDA runtime";
+        b.caps = {32, true, true, 1};
+        b.available = cuda_available;
+#define SET(fn) b.fn = cuda_impl::fn;
+        NN_BACKEND_FUNCTIONS(SET)
+#undef SET
+        return b;
+    }();
+    return &backend;
+}
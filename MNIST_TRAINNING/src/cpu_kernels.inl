@@ -0,0 +1,1229 @@
+// CPU kernels shared by the scalar, AVX2 and AVX-512 backends. Each backend
+// includes this file once, inside an anonymous namespace and under its own
+// `#pragma GCC target`, so the same loops are compiled for every ISA.
+// The including file provides the standard headers and may define
+// CPU_SCALAR to get the non-vectorized reference.
+
+#define CPU_PRAGMA(x) _Pragma(#x)
+#ifdef CPU_SCALAR
+#define CPU_SIMD
+#define CPU_SIMD_REDUCE(op, var)
+#else
+#define CPU_SIMD CPU_PRAGMA(omp simd)
+#define CPU_SIMD_REDUCE(op, var) CPU_PRAGMA(omp simd reduction(op:var))
+#endif
+
+// Below this many multiply-adds a kernel stays on the calling thread,
+// waking the OpenMP team would cost more than the work itself.
+const long parallel_threshold = 1 << 15;
+
+// How many FFT-convolution flops cost as much as one flop of the spatial
+// kernels (NCHWc, GEMM), for the convolution algorithm heuristic (conv2d_choose)
+const double fft_penalty = 6.0;
+
+void relu_activation(float* input, float* output, int size) {
+    #pragma omp parallel for if(size > parallel_threshold)
+    for (int i = 0; i < size; ++i)
+        output[i] = input[i] > 0.0f ? input[i] : 0.0f;
+}
+
+void pixels_to_float(unsigned char* pixels, float* output, float scale, float shift, int size) {
+    #pragma omp parallel for if(size > parallel_threshold)
+    for (int i = 0; i < size; ++i)
+        output[i] = pixels[i] * scale + shift;
+}
+
+// expf that vectorizes: libm's expf stays a scalar call inside simd loops
+// unless the build uses -ffast-math. Cephes-style range reduction
+// x = n ln2 + r with a degree 6 polynomial for e^r, within 2 ulp of expf
+// over the range softmax uses (x <= 0). The scalar reference keeps libm.
+#ifdef CPU_SCALAR
+inline float cpu_expf(float x) {
+    return expf(x);
+}
+#else
+inline float cpu_expf(float x) {
+    x = x < -87.3f ? -87.3f : (x > 88.3f ? 88.3f : x);
+    float t = x * 1.44269504f;
+    int n = (int)(t < 0.0f ? t - 0.5f : t + 0.5f);
+    float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    // 2^n built directly in the exponent field
+    return p * __builtin_bit_cast(float, (n + 127) << 23);
+}
+#endif
+
+// Max and sum(exp(x - max)) of one row in a single read (online softmax).
+// Each SIMD lane keeps its own running max and sum; when a lane's max grows
+// its sum is rescaled, so every element costs one exponential whichever way
+// the comparison goes. The lanes are merged at the end.
+void softmax_row_stats(const float* x, int n, float& max_out, float& sum_out) {
+    const int lanes = CPU_VECTOR_WIDTH;
+    float m[lanes], s[lanes];
+    int i = 0;
+
+    if (n >= lanes) {
+        for (int l = 0; l < lanes; ++l) {
+            m[l] = x[l];
+            s[l] = 1.0f;
+        }
+        for (i = lanes; i + lanes <= n; i += lanes) {
+            CPU_SIMD
+            for (int l = 0; l < lanes; ++l) {
+                float v = x[i + l];
+                float d = v - m[l];
+                bool grew = d > 0.0f;
+                float e = cpu_expf(grew ? -d : d);
+                s[l] = grew ? s[l] * e + 1.0f : s[l] + e;
+                m[l] = grew ? v : m[l];
+            }
+        }
+    }
+
+    float max_val = -INFINITY;
+    for (int l = 0; n >= lanes && l < lanes; ++l)
+        max_val = fmaxf(max_val, m[l]);
+    for (int j = i; j < n; ++j)
+        max_val = fmaxf(max_val, x[j]);
+
+    float sum = 0.0f;
+    for (int l = 0; n >= lanes && l < lanes; ++l)
+        sum += s[l] * cpu_expf(m[l] - max_val);
+    for (int j = i; j < n; ++j)
+        sum += cpu_expf(x[j] - max_val);
+
+    max_out = max_val;
+    sum_out = sum;
+}
+
+// Rows run in parallel, each one is read twice: once for its statistics and
+// once to write the probabilities, so input may alias output.
+void softmax(float* input, float* output, int batch_size, int size) {
+    #pragma omp parallel for if((long)batch_size * size > parallel_threshold)
+    for (int b = 0; b < batch_size; ++b) {
+        const float* in = input + (long)b * size;
+        float* out = output + (long)b * size;
+
+        float max_val, sum;
+        softmax_row_stats(in, size, max_val, sum);
+
+        float inv = 1.0f / sum;
+        CPU_SIMD
+        for (int i = 0; i < size; ++i)
+            out[i] = cpu_expf(in[i] - max_val) * inv;
+    }
+}
+
+// Blocked GEMM engine: C = beta * C + op(A) * op(B) (+ bias), all row-major.
+// op(A) is M x K, op(B) is K x N. Panels of A (gemm_mr rows) and B (gemm_nr
+// columns) are packed contiguously for each KC-deep slice so the micro-kernel
+// streams both from L1/L2 while the gemm_mr x gemm_nr accumulator tile stays
+// in vector registers. The packing buffers belong to the calling thread and
+// are reused from call to call.
+#ifdef CPU_SCALAR
+const int gemm_mr = 4;
+const int gemm_nr = 4;
+#else
+const int gemm_mr = 6;
+const int gemm_nr = 2 * CPU_VECTOR_WIDTH;
+#endif
+const int gemm_kc = 256;
+const int gemm_mc = 32 * gemm_mr;
+const int gemm_nc = 64 * gemm_nr;
+
+enum GemmBias { BIAS_NONE, BIAS_PER_COL, BIAS_PER_ROW };
+
+float* gemm_workspace(std::vector<float>& buffer, size_t size) {
+    if (buffer.size() < size)
+        buffer.resize(size);
+    return buffer.data();
+}
+
+// mc x kc block of op(A), one panel of gemm_mr rows after the other,
+// rows past the edge are zero so the micro-kernel never branches
+void gemm_pack_a(bool trans, const float* A, int lda, int row0, int mc, int k0, int kc, float* dst) {
+    int panels = (mc + gemm_mr - 1) / gemm_mr;
+    #pragma omp parallel for if((long)mc * kc > parallel_threshold)
+    for (int p = 0; p < panels; ++p) {
+        float* d = dst + (long)p * kc * gemm_mr;
+        for (int r = 0; r < gemm_mr; ++r) {
+            int row = p * gemm_mr + r;
+            if (row >= mc) {
+                for (int k = 0; k < kc; ++k)
+                    d[k * gemm_mr + r] = 0.0f;
+            } else if (trans) {
+                for (int k = 0; k < kc; ++k)
+                    d[k * gemm_mr + r] = A[(long)(k0 + k) * lda + row0 + row];
+            } else {
+                const float* a = A + (long)(row0 + row) * lda + k0;
+                for (int k = 0; k < kc; ++k)
+                    d[k * gemm_mr + r] = a[k];
+            }
+        }
+    }
+}
+
+// kc x nc block of op(B), one panel of gemm_nr columns after the other
+void gemm_pack_b(bool trans, const float* B, int ldb, int k0, int kc, int col0, int nc, float* dst) {
+    int panels = (nc + gemm_nr - 1) / gemm_nr;
+    #pragma omp parallel for if((long)nc * kc > parallel_threshold)
+    for (int p = 0; p < panels; ++p) {
+        float* d = dst + (long)p * kc * gemm_nr;
+        int n = std::min(gemm_nr, nc - p * gemm_nr);
+        int c0 = col0 + p * gemm_nr;
+        if (trans) {
+            for (int j = 0; j < gemm_nr; ++j) {
+                const float* b = B + (long)(c0 + j) * ldb + k0;
+                for (int k = 0; k < kc; ++k)
+                    d[k * gemm_nr + j] = j < n ? b[k] : 0.0f;
+            }
+        } else {
+            for (int k = 0; k < kc; ++k) {
+                const float* b = B + (long)(k0 + k) * ldb + c0;
+                for (int j = 0; j < gemm_nr; ++j)
+                    d[k * gemm_nr + j] = j < n ? b[j] : 0.0f;
+            }
+        }
+    }
+}
+
+// One gemm_mr x gemm_nr tile of C, of which only m x n is real. The bias is
+// added on the first K slice only, later slices accumulate into C.
+inline void gemm_micro(int kc, const float* a, const float* b, float* c, int ldc, int m, int n,
+                       float beta, const float* bias, GemmBias bias_mode) {
+    float acc[gemm_mr][gemm_nr] = {};
+    for (int k = 0; k < kc; ++k) {
+        const float* bk = b + k * gemm_nr;
+        for (int r = 0; r < gemm_mr; ++r) {
+            float av = a[k * gemm_mr + r];
+            CPU_SIMD
+            for (int j = 0; j < gemm_nr; ++j)
+                acc[r][j] += av * bk[j];
+        }
+    }
+    for (int r = 0; r < m; ++r) {
+        float* cr = c + (long)r * ldc;
+        float row_bias = bias_mode == BIAS_PER_ROW ? bias[r] : 0.0f;
+        for (int j = 0; j < n; ++j) {
+            float v = acc[r][j] + row_bias + (bias_mode == BIAS_PER_COL ? bias[j] : 0.0f);
+            cr[j] = beta == 0.0f ? v : beta * cr[j] + v;
+        }
+    }
+}
+
+void gemm(bool trans_a, bool trans_b, int M, int N, int K,
+          const float* A, int lda, const float* B, int ldb,
+          float* C, int ldc, float beta, const float* bias, GemmBias bias_mode) {
+    thread_local std::vector<float> a_buffer, b_buffer;
+    float* pa = gemm_workspace(a_buffer, (size_t)gemm_mc * gemm_kc);
+    float* pb = gemm_workspace(b_buffer, (size_t)gemm_nc * gemm_kc);
+
+    for (int jc = 0; jc < N; jc += gemm_nc) {
+        int nc = std::min(gemm_nc, N - jc);
+        for (int pc = 0; pc < K; pc += gemm_kc) {
+            int kc = std::min(gemm_kc, K - pc);
+            bool first = pc == 0;
+            gemm_pack_b(trans_b, B, ldb, pc, kc, jc, nc, pb);
+
+            for (int ic = 0; ic < M; ic += gemm_mc) {
+                int mc = std::min(gemm_mc, M - ic);
+                gemm_pack_a(trans_a, A, lda, ic, mc, pc, kc, pa);
+
+                int row_panels = (mc + gemm_mr - 1) / gemm_mr;
+                int col_panels = (nc + gemm_nr - 1) / gemm_nr;
+                long work = (long)mc * nc * kc;
+                #pragma omp parallel for collapse(2) if(work > parallel_threshold)
+                for (int jr = 0; jr < col_panels; ++jr) {
+                    for (int ir = 0; ir < row_panels; ++ir) {
+                        int row = ic + ir * gemm_mr;
+                        int col = jc + jr * gemm_nr;
+                        const float* tile_bias = bias_mode == BIAS_PER_ROW ? bias + row
+                                               : bias_mode == BIAS_PER_COL ? bias + col : nullptr;
+                        gemm_micro(kc, pa + (long)ir * kc * gemm_mr, pb + (long)jr * kc * gemm_nr,
+                                   C + (long)row * ldc + col, ldc,
+                                   std::min(gemm_mr, M - row), std::min(gemm_nr, N - col),
+                                   first ? beta : 1.0f, tile_bias, first ? bias_mode : BIAS_NONE);
+                    }
+                }
+            }
+        }
+    }
+    // K == 0 still owes C its beta scaling and bias
+    if (K == 0) {
+        for (int r = 0; r < M; ++r)
+            for (int j = 0; j < N; ++j) {
+                float v = bias_mode == BIAS_PER_ROW ? bias[r] : bias_mode == BIAS_PER_COL ? bias[j] : 0.0f;
+                C[(long)r * ldc + j] = beta == 0.0f ? v : beta * C[(long)r * ldc + j] + v;
+            }
+    }
+}
+
+// output[b][o] = input[b] . weights[o] + bias[o] for the whole batch in one GEMM,
+// so every weight row is loaded once per batch instead of once per sample
+void fc_forward(float* input, float* weights, float* bias,
+                float* output, int batch_size, int input_size, int output_size) {
+    // Fewer samples than a micro-kernel tile: packing the weights would cost
+    // more than the product, use dot products over each weight row instead
+    if (batch_size < gemm_mr) {
+        long work = (long)batch_size * input_size * output_size;
+        #pragma omp parallel for if(work > parallel_threshold)
+        for (int o = 0; o < output_size; ++o) {
+            const float* w = weights + (long)o * input_size;
+            for (int b = 0; b < batch_size; ++b) {
+                const float* in = input + (long)b * input_size;
+                float sum = 0.0f;
+                CPU_SIMD_REDUCE(+, sum)
+                for (int i = 0; i < input_size; ++i)
+                    sum += in[i] * w[i];
+                output[(long)b * output_size + o] = sum + bias[o];
+            }
+        }
+        return;
+    }
+    gemm(false, true, batch_size, output_size, input_size,
+         input, input_size, weights, input_size, output, output_size, 0.0f, bias, BIAS_PER_COL);
+}
+
+void fc_backward(float* input, float* weights, float* grad_output,
+                 float* grad_input, float* grad_weights, float* grad_bias,
+                 int batch_size, int input_size, int output_size) {
+    // dW (output_size x input_size) = dY^T * X, both read in place by the packing
+    gemm(true, false, output_size, input_size, batch_size,
+         grad_output, output_size, input, input_size, grad_weights, input_size, 0.0f, nullptr, BIAS_NONE);
+
+    // db = column sums of dY, accumulated row by row so the loop runs along memory
+    for (int o = 0; o < output_size; ++o)
+        grad_bias[o] = 0.0f;
+    for (int b = 0; b < batch_size; ++b) {
+        const float* dy = grad_output + (long)b * output_size;
+        CPU_SIMD
+        for (int o = 0; o < output_size; ++o)
+            grad_bias[o] += dy[o];
+    }
+
+    // dX (batch_size x input_size) = dY * W
+    if (grad_input)
+        gemm(false, false, batch_size, input_size, output_size,
+             grad_output, output_size, weights, input_size, grad_input, input_size, 0.0f, nullptr, BIAS_NONE);
+}
+
+// Unrolls the receptive fields of one image (channels x height x width) into
+// a (channels * k * k) x (out_h * out_w) matrix: row (c, ki, kj) holds the
+// input pixel under kernel tap (ki, kj) for every output position, zero where
+// the tap falls in the padding.
+void im2col(const float* input, int channels, int height, int width, int kernel_size,
+            int stride, int padding, int out_h, int out_w, float* col) {
+    int rows = channels * kernel_size * kernel_size;
+    #pragma omp parallel for if((long)rows * out_h * out_w > parallel_threshold)
+    for (int r = 0; r < rows; ++r) {
+        int c = r / (kernel_size * kernel_size);
+        int ki = r / kernel_size % kernel_size;
+        int kj = r % kernel_size;
+        // Output columns whose tap lands inside the image
+        int lo = std::max(0, (padding - kj + stride - 1) / stride);
+        int hi = std::max(lo, std::min(out_w, (width + padding - kj + stride - 1) / stride));
+        float* dst = col + (long)r * out_h * out_w;
+
+        for (int oy = 0; oy < out_h; ++oy, dst += out_w) {
+            int iy = oy * stride - padding + ki;
+            if (iy < 0 || iy >= height) {
+                for (int ox = 0; ox < out_w; ++ox)
+                    dst[ox] = 0.0f;
+                continue;
+            }
+            const float* src = input + ((long)c * height + iy) * width - padding + kj;
+            for (int ox = 0; ox < lo; ++ox)
+                dst[ox] = 0.0f;
+            if (stride == 1) {
+                memcpy(dst + lo, src + lo, (hi - lo) * sizeof(float));
+            } else {
+                for (int ox = lo; ox < hi; ++ox)
+                    dst[ox] = src[ox * stride];
+            }
+            for (int ox = hi; ox < out_w; ++ox)
+                dst[ox] = 0.0f;
+        }
+    }
+}
+
+// Few filters, stride 1, no padding: accumulate every output row straight
+// from the input rows, the inner loop contiguous in both, no column matrix
+void conv2d_rows(const float* input, const float* weights, const float* bias, float* output,
+                 int in_channels, int height, int width, int out_channels, int kernel_size,
+                 int out_h, int out_w) {
+    long work = (long)out_channels * out_h * out_w * in_channels * kernel_size * kernel_size;
+    #pragma omp parallel for collapse(2) if(work > parallel_threshold)
+    for (int o = 0; o < out_channels; ++o) {
+        for (int row = 0; row < out_h; ++row) {
+            float* out = output + ((long)o * out_h + row) * out_w;
+            float bias_val = bias ? bias[o] : 0.0f;
+            for (int col = 0; col < out_w; ++col)
+                out[col] = bias_val;
+            for (int c = 0; c < in_channels; ++c) {
+                const float* w = weights + ((long)o * in_channels + c) * kernel_size * kernel_size;
+                for (int i = 0; i < kernel_size; ++i) {
+                    const float* in = input + ((long)c * height + row + i) * width;
+                    for (int j = 0; j < kernel_size; ++j) {
+                        float k = w[i * kernel_size + j];
+                        CPU_SIMD
+                        for (int col = 0; col < out_w; ++col)
+                            out[col] += in[col + j] * k;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Transformed filters are cached per weights buffer (filter_cache_find in
+// backend.h), so a layer pays for the transform once rather than on every
+// call. sgd_update, copy_to_device and device_free drop the entries of the
+// buffers they write. Entries are tagged with this backend's own address,
+// the layouts differ between backends.
+const char filter_cache_owner = 0;
+
+// The cached transform of `weights` for `key`, built by make() on a miss
+template <typename F>
+std::shared_ptr<const std::vector<float>> cached_filters(const float* weights, size_t bytes,
+                                                         const std::array<int, 6>& key, F make) {
+    if (FilterData data = filter_cache_find(&filter_cache_owner, weights, key))
+        return data;
+    return filter_cache_insert(&filter_cache_owner, weights, bytes, key, make());
+}
+
+// Winograd minimal filtering F(m x m, 3 x 3): an (m + 2) x (m + 2) input tile
+// d and a 3x3 filter g give an m x m output tile A^T [(G g G^T) .* (B^T d B)] A.
+// Per tile and channel pair that is (m + 2)^2 multiplies instead of 9 m^2:
+// 16 vs 36 for F(2x2), 36 vs 144 for F(4x4). Summed over input channels the
+// element-wise products become (m + 2)^2 independent GEMMs, run on the
+// blocked engine above.
+//
+// The input and output transforms are written out as their 1-D row
+// operations and run on winograd_lanes tiles at once, one tile per SIMD lane.
+// `input` applies B^T and `output` A^T along one dimension: element k of
+// every lane is at x[k * xs + lane], result i at r[i * rs + lane].
+const int winograd_lanes = CPU_VECTOR_WIDTH;
+
+template <int M> struct Winograd;
+
+template <> struct Winograd<2> {
+    static constexpr int alpha = 4;
+    static constexpr float G[4][3] = {
+        {1, 0, 0}, {0.5f, 0.5f, 0.5f}, {0.5f, -0.5f, 0.5f}, {0, 0, 1}};
+
+    static void input(const float* x, long xs, float* r, long rs) {
+        CPU_SIMD
+        for (int l = 0; l < winograd_lanes; ++l) {
+            float d0 = x[l], d1 = x[xs + l], d2 = x[2 * xs + l], d3 = x[3 * xs + l];
+            r[l] = d0 - d2;
+            r[rs + l] = d1 + d2;
+            r[2 * rs + l] = d2 - d1;
+            r[3 * rs + l] = d1 - d3;
+        }
+    }
+
+    static void output(const float* x, long xs, float* r, long rs) {
+        CPU_SIMD
+        for (int l = 0; l < winograd_lanes; ++l) {
+            float m0 = x[l], m1 = x[xs + l], m2 = x[2 * xs + l], m3 = x[3 * xs + l];
+            r[l] = m0 + m1 + m2;
+            r[rs + l] = m1 - m2 - m3;
+        }
+    }
+};
+
+template <> struct Winograd<4> {
+    static constexpr int alpha = 6;
+    static constexpr float G[6][3] = {
+        {1.0f / 4, 0, 0}, {-1.0f / 6, -1.0f / 6, -1.0f / 6}, {-1.0f / 6, 1.0f / 6, -1.0f / 6},
+        {1.0f / 24, 1.0f / 12, 1.0f / 6}, {1.0f / 24, -1.0f / 12, 1.0f / 6}, {0, 0, 1}};
+
+    static void input(const float* x, long xs, float* r, long rs) {
+        CPU_SIMD
+        for (int l = 0; l < winograd_lanes; ++l) {
+            float d0 = x[l], d1 = x[xs + l], d2 = x[2 * xs + l];
+            float d3 = x[3 * xs + l], d4 = x[4 * xs + l], d5 = x[5 * xs + l];
+            r[l] = 4.0f * d0 - 5.0f * d2 + d4;
+            r[rs + l] = d3 + d4 - 4.0f * (d1 + d2);
+            r[2 * rs + l] = d4 - d3 + 4.0f * (d1 - d2);
+            r[3 * rs + l] = d4 - d2 + 2.0f * (d3 - d1);
+            r[4 * rs + l] = d4 - d2 + 2.0f * (d1 - d3);
+            r[5 * rs + l] = 4.0f * d1 - 5.0f * d3 + d5;
+        }
+    }
+
+    static void output(const float* x, long xs, float* r, long rs) {
+        CPU_SIMD
+        for (int l = 0; l < winograd_lanes; ++l) {
+            float m0 = x[l], m1 = x[xs + l], m2 = x[2 * xs + l];
+            float m3 = x[3 * xs + l], m4 = x[4 * xs + l], m5 = x[5 * xs + l];
+            float a = m1 + m2, b = m1 - m2, c = m3 + m4, d = m3 - m4;
+            r[l] = m0 + a + c;
+            r[rs + l] = b + 2.0f * d;
+            r[2 * rs + l] = a + 4.0f * c;
+            r[3 * rs + l] = b + 8.0f * d + m5;
+        }
+    }
+};
+
+// u[e * stride] for e = xi * alpha + nu holds (G g G^T)[xi][nu]. Filters are
+// transformed once per cache entry, so this stays a plain matrix product.
+template <int M>
+void winograd_filter(const float* g, float* u, long stride) {
+    constexpr int A = Winograd<M>::alpha;
+    const auto& G = Winograd<M>::G;
+    float t[A][3];
+    for (int i = 0; i < A; ++i)
+        for (int j = 0; j < 3; ++j)
+            t[i][j] = G[i][0] * g[j] + G[i][1] * g[3 + j] + G[i][2] * g[6 + j];
+    for (int i = 0; i < A; ++i)
+        for (int j = 0; j < A; ++j)
+            u[(i * A + j) * stride] = t[i][0] * G[j][0] + t[i][1] * G[j][1] + t[i][2] * G[j][2];
+}
+
+// alpha^2 x out_channels x in_channels
+template <int M>
+std::shared_ptr<const std::vector<float>> winograd_filters(const float* weights, int out_channels, int in_channels) {
+    constexpr int A = Winograd<M>::alpha;
+    long stride = (long)out_channels * in_channels;
+    return cached_filters(weights, stride * 9 * sizeof(float), {CONV_WINOGRAD, M, 0, out_channels, in_channels, 3}, [&] {
+        auto u = std::make_shared<std::vector<float>>((size_t)A * A * stride);
+        #pragma omp parallel for if(stride * A * A > parallel_threshold)
+        for (long oc = 0; oc < stride; ++oc)
+            winograd_filter<M>(weights + oc * 9, u->data() + oc, stride);
+        return u;
+    });
+}
+
+// Stride 1, 3x3 kernel. The m x m output tiles of every image in a pass are
+// numbered p = image * tiles + tile and laid out along the GEMM columns,
+// padded to a whole number of lane groups. Each group of tiles is gathered,
+// transformed, multiplied per Winograd coordinate and transformed back;
+// tiles past the output edge read zeros and are cropped on the way out.
+template <int M>
+void conv2d_winograd(const float* input, const float* weights, const float* bias, float* output,
+                     int batch_size, int in_channels, int height, int width,
+                     int out_channels, int padding, int out_h, int out_w) {
+    constexpr int A = Winograd<M>::alpha;
+    constexpr int L = winograd_lanes;
+    int tiles_w = (out_w + M - 1) / M;
+    int tiles = (out_h + M - 1) / M * tiles_w;
+    auto filters = winograd_filters<M>(weights, out_channels, in_channels);
+    const float* U = filters->data();
+
+    // Images per pass, keeping the transformed tiles to about 16 MB
+    long per_image = (long)A * A * (in_channels + out_channels) * tiles;
+    int images = (int)std::max(1L, (1L << 22) / per_image);
+    thread_local std::vector<float> v_buffer, m_buffer;
+
+    for (int b0 = 0; b0 < batch_size; b0 += images) {
+        int nb = std::min(images, batch_size - b0);
+        long P = (long)nb * tiles;
+        long groups = (P + L - 1) / L;
+        long ldp = groups * L;
+        float* V = gemm_workspace(v_buffer, (size_t)A * A * in_channels * ldp);
+        float* Mt = gemm_workspace(m_buffer, (size_t)A * A * out_channels * ldp);
+
+        #pragma omp parallel for collapse(2) if(per_image * nb > parallel_threshold)
+        for (int c = 0; c < in_channels; ++c) {
+            for (long g = 0; g < groups; ++g) {
+                float d[A][A][L], t[A][A][L];
+                for (int l = 0; l < L; ++l) {
+                    long p = g * L + l;
+                    int b = (int)(p / tiles), tile = (int)(p % tiles);
+                    int y0 = tile / tiles_w * M - padding;
+                    int x0 = tile % tiles_w * M - padding;
+                    const float* in = input + ((long)(b0 + b) * in_channels + c) * height * width;
+                    if (p < P && y0 >= 0 && x0 >= 0 && y0 + A <= height && x0 + A <= width) {
+                        const float* src = in + (long)y0 * width + x0;
+                        for (int i = 0; i < A; ++i)
+                            for (int j = 0; j < A; ++j)
+                                d[i][j][l] = src[(long)i * width + j];
+                        continue;
+                    }
+                    for (int i = 0; i < A; ++i)
+                        for (int j = 0; j < A; ++j) {
+                            int iy = y0 + i, ix = x0 + j;
+                            bool inside = p < P && iy >= 0 && iy < height && ix >= 0 && ix < width;
+                            d[i][j][l] = inside ? in[(long)iy * width + ix] : 0.0f;
+                        }
+                }
+                for (int j = 0; j < A; ++j)
+                    Winograd<M>::input(&d[0][j][0], A * L, &t[0][j][0], A * L);
+                for (int i = 0; i < A; ++i)
+                    Winograd<M>::input(&t[i][0][0], L, V + ((long)i * A * in_channels + c) * ldp + g * L,
+                                       (long)in_channels * ldp);
+            }
+        }
+
+        for (int e = 0; e < A * A; ++e)
+            gemm(false, false, out_channels, (int)P, in_channels,
+                 U + (long)e * out_channels * in_channels, in_channels,
+                 V + (long)e * in_channels * ldp, (int)ldp,
+                 Mt + (long)e * out_channels * ldp, (int)ldp, 0.0f, nullptr, BIAS_NONE);
+
+        #pragma omp parallel for collapse(2) if(per_image * nb > parallel_threshold)
+        for (int o = 0; o < out_channels; ++o) {
+            for (long g = 0; g < groups; ++g) {
+                float t[M][A][L], y[M][M][L];
+                for (int i = 0; i < A; ++i) {
+                    float s[A][L];
+                    const float* m = Mt + ((long)i * A * out_channels + o) * ldp + g * L;
+                    Winograd<M>::output(m, (long)out_channels * ldp, &s[0][0], L);
+                    for (int k = 0; k < M; ++k)
+                        for (int l = 0; l < L; ++l)
+                            t[k][i][l] = s[k][l];
+                }
+                // t[k] is output column k, transforming it gives the rows
+                for (int k = 0; k < M; ++k)
+                    Winograd<M>::output(&t[k][0][0], L, &y[0][k][0], M * L);
+
+                float bias_val = bias ? bias[o] : 0.0f;
+                for (int l = 0; l < L; ++l) {
+                    long p = g * L + l;
+                    if (p >= P)
+                        break;
+                    int b = (int)(p / tiles), tile = (int)(p % tiles);
+                    int y0 = tile / tiles_w * M, x0 = tile % tiles_w * M;
+                    float* out = output + ((long)(b0 + b) * out_channels + o) * out_h * out_w;
+                    if (y0 + M <= out_h && x0 + M <= out_w) {
+                        for (int i = 0; i < M; ++i)
+                            for (int j = 0; j < M; ++j)
+                                out[(long)(y0 + i) * out_w + x0 + j] = y[i][j][l] + bias_val;
+                        continue;
+                    }
+                    for (int i = 0; i < M && y0 + i < out_h; ++i)
+                        for (int j = 0; j < M && x0 + j < out_w; ++j)
+                            out[(long)(y0 + i) * out_w + x0 + j] = y[i][j][l] + bias_val;
+                }
+            }
+        }
+    }
+}
+
+// Radix-2 FFT convolution. Images and filters are zero-padded to Nh x Nw
+// (powers of two, at least the padded input so the circular correlation
+// never wraps into the outputs we keep). Real input only needs the
+// non-negative half of one frequency axis, so spectra are Nh x (Nw/2 + 1)
+// complex values, stored as separate real and imaginary planes laid out
+// [v][u]. A layer is then a complex multiply-accumulate per frequency,
+// out = IFFT(sum_c X_c * conj(W_c)), independent of the kernel size.
+struct FftPlan {
+    int n;
+    std::vector<int> bitrev;
+    std::vector<float> cos_table, sin_table;    // cos, sin of 2 pi k / n for k < n / 2
+};
+
+const FftPlan& fft_plan(int n) {
+    thread_local std::vector<FftPlan> plans;
+    for (const FftPlan& p : plans)
+        if (p.n == n)
+            return p;
+    FftPlan p;
+    p.n = n;
+    p.bitrev.resize(n);
+    int bits = 0;
+    while ((1 << bits) < n)
+        ++bits;
+    for (int i = 0; i < n; ++i) {
+        int r = 0;
+        for (int b = 0; b < bits; ++b)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        p.bitrev[i] = r;
+    }
+    for (int k = 0; k < n / 2; ++k) {
+        double angle = 2.0 * M_PI * k / n;
+        p.cos_table.push_back((float)cos(angle));
+        p.sin_table.push_back((float)sin(angle));
+    }
+    plans.push_back(std::move(p));
+    return plans.back();
+}
+
+// In-place FFT of length n along the first dimension of a complex array,
+// element k of transform j at re/im[k * stride + j]: `count` transforms run
+// side by side, so every butterfly is a SIMD loop over j.
+void fft_columns(float* re, float* im, int n, long stride, int count, bool inverse) {
+    const FftPlan& plan = fft_plan(n);
+    for (int i = 0; i < n; ++i) {
+        int r = plan.bitrev[i];
+        if (r <= i)
+            continue;
+        float* ar = re + i * stride; float* ai = im + i * stride;
+        float* br = re + r * stride; float* bi = im + r * stride;
+        for (int j = 0; j < count; ++j) {
+            std::swap(ar[j], br[j]);
+            std::swap(ai[j], bi[j]);
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        int half = len / 2, step = n / len;
+        for (int s = 0; s < n; s += len)
+            for (int k = 0; k < half; ++k) {
+                float wr = plan.cos_table[k * step];
+                float wi = inverse ? plan.sin_table[k * step] : -plan.sin_table[k * step];
+                float* ar = re + (s + k) * stride; float* ai = im + (s + k) * stride;
+                float* br = ar + half * stride; float* bi = ai + half * stride;
+                CPU_SIMD
+                for (int j = 0; j < count; ++j) {
+                    float tr = br[j] * wr - bi[j] * wi;
+                    float ti = br[j] * wi + bi[j] * wr;
+                    br[j] = ar[j] - tr;
+                    bi[j] = ai[j] - ti;
+                    ar[j] += tr;
+                    ai[j] += ti;
+                }
+            }
+    }
+}
+
+// Half spectrum of a rows x cols real block placed at (offset, offset) in an
+// otherwise zero Nh x Nw grid. spec_re/spec_im hold (Nw/2 + 1) * Nh values.
+void fft_forward_2d(const float* src, int rows, int cols, int offset, int Nh, int Nw,
+                    float* spec_re, float* spec_im) {
+    thread_local std::vector<float> a_buffer, b_buffer;
+    float* a = gemm_workspace(a_buffer, (size_t)2 * Nh * Nw);
+    float* b = gemm_workspace(b_buffer, (size_t)2 * Nh * Nw);
+    float* ar = a; float* ai = a + (long)Nh * Nw;
+    float* br = b; float* bi = b + (long)Nh * Nw;
+
+    // Along y, all columns at once
+    memset(a, 0, sizeof(float) * 2 * Nh * Nw);
+    for (int y = 0; y < rows; ++y)
+        memcpy(ar + (long)(y + offset) * Nw + offset, src + (long)y * cols, cols * sizeof(float));
+    fft_columns(ar, ai, Nh, Nw, Nw, false);
+    // Transpose to [x][u], then along x for every u
+    for (int u = 0; u < Nh; ++u)
+        for (int x = 0; x < Nw; ++x) {
+            br[(long)x * Nh + u] = ar[(long)u * Nw + x];
+            bi[(long)x * Nh + u] = ai[(long)u * Nw + x];
+        }
+    fft_columns(br, bi, Nw, Nh, Nh, false);
+    size_t half = (size_t)(Nw / 2 + 1) * Nh;
+    memcpy(spec_re, br, half * sizeof(float));
+    memcpy(spec_im, bi, half * sizeof(float));
+}
+
+// out (out_h x out_w) = scale * real(IFFT(spectrum)) + bias, the missing half
+// of the spectrum rebuilt from Hermitian symmetry
+void fft_inverse_2d(const float* spec_re, const float* spec_im, int Nh, int Nw,
+                    float* out, int out_h, int out_w, float scale, float bias) {
+    thread_local std::vector<float> a_buffer, b_buffer;
+    float* a = gemm_workspace(a_buffer, (size_t)2 * Nh * Nw);
+    float* b = gemm_workspace(b_buffer, (size_t)2 * Nh * Nw);
+    float* ar = a; float* ai = a + (long)Nh * Nw;
+    float* br = b; float* bi = b + (long)Nh * Nw;
+
+    size_t half = (size_t)(Nw / 2 + 1) * Nh;
+    memcpy(ar, spec_re, half * sizeof(float));
+    memcpy(ai, spec_im, half * sizeof(float));
+    for (int v = Nw / 2 + 1; v < Nw; ++v)
+        for (int u = 0; u < Nh; ++u) {
+            long mirror = (long)(Nw - v) * Nh + ((Nh - u) & (Nh - 1));
+            ar[(long)v * Nh + u] = spec_re[mirror];
+            ai[(long)v * Nh + u] = -spec_im[mirror];
+        }
+    // Along v, then back to [u][x] keeping only the columns we output
+    fft_columns(ar, ai, Nw, Nh, Nh, true);
+    for (int u = 0; u < Nh; ++u)
+        for (int x = 0; x < out_w; ++x) {
+            br[(long)u * out_w + x] = ar[(long)x * Nh + u];
+            bi[(long)u * out_w + x] = ai[(long)x * Nh + u];
+        }
+    fft_columns(br, bi, Nh, out_w, out_w, true);
+    for (int y = 0; y < out_h; ++y) {
+        const float* src = br + (long)y * out_w;
+        float* dst = out + (long)y * out_w;
+        CPU_SIMD
+        for (int x = 0; x < out_w; ++x)
+            dst[x] = src[x] * scale + bias;
+    }
+}
+
+int fft_size(int n) {
+    int size = 2;
+    while (size < n)
+        size <<= 1;
+    return size;
+}
+
+// Filter spectra, out_channels x in_channels, each a real then an imaginary plane
+std::shared_ptr<const std::vector<float>> fft_filters(const float* weights, int out_channels, int in_channels,
+                                                      int kernel_size, int Nh, int Nw) {
+    long filters = (long)out_channels * in_channels;
+    long spectrum = (long)(Nw / 2 + 1) * Nh;
+    return cached_filters(weights, filters * kernel_size * kernel_size * sizeof(float),
+                          {CONV_FFT, Nh, Nw, out_channels, in_channels, kernel_size}, [&] {
+        auto spectra = std::make_shared<std::vector<float>>((size_t)filters * 2 * spectrum);
+        #pragma omp parallel for if(filters * Nh * Nw > parallel_threshold)
+        for (long f = 0; f < filters; ++f) {
+            float* dst = spectra->data() + f * 2 * spectrum;
+            fft_forward_2d(weights + f * kernel_size * kernel_size, kernel_size, kernel_size, 0,
+                           Nh, Nw, dst, dst + spectrum);
+        }
+        return spectra;
+    });
+}
+
+// Stride 1. Every image channel is transformed once per pass (batched
+// across images and channels), then each (image, filter) pair accumulates
+// its spectrum over the input channels and is transformed back.
+void conv2d_fft(const float* input, const float* weights, const float* bias, float* output,
+                int batch_size, int in_channels, int height, int width,
+                int out_channels, int kernel_size, int padding, int out_h, int out_w) {
+    int Nh = fft_size(height + 2 * padding);
+    int Nw = fft_size(width + 2 * padding);
+    long spectrum = (long)(Nw / 2 + 1) * Nh;
+    auto filters = fft_filters(weights, out_channels, in_channels, kernel_size, Nh, Nw);
+    const float* W = filters->data();
+    float scale = 1.0f / ((float)Nh * Nw);
+
+    // Images per pass, keeping the input spectra to about 16 MB
+    long per_image = (long)in_channels * 2 * spectrum;
+    int images = (int)std::max(1L, (1L << 22) / per_image);
+    thread_local std::vector<float> x_buffer;
+
+    for (int b0 = 0; b0 < batch_size; b0 += images) {
+        int nb = std::min(images, batch_size - b0);
+        float* X = gemm_workspace(x_buffer, (size_t)nb * per_image);
+
+        #pragma omp parallel for if((long)nb * in_channels * Nh * Nw > parallel_threshold)
+        for (long bc = 0; bc < (long)nb * in_channels; ++bc) {
+            float* dst = X + bc * 2 * spectrum;
+            fft_forward_2d(input + ((long)b0 * in_channels + bc) * height * width, height, width, padding,
+                           Nh, Nw, dst, dst + spectrum);
+        }
+
+        #pragma omp parallel for collapse(2) if((long)nb * out_channels * in_channels * spectrum > parallel_threshold)
+        for (int b = 0; b < nb; ++b) {
+            for (int o = 0; o < out_channels; ++o) {
+                thread_local std::vector<float> y_buffer;
+                float* yr = gemm_workspace(y_buffer, (size_t)2 * spectrum);
+                float* yi = yr + spectrum;
+                memset(yr, 0, sizeof(float) * 2 * spectrum);
+                for (int c = 0; c < in_channels; ++c) {
+                    const float* xr = X + ((long)b * in_channels + c) * 2 * spectrum;
+                    const float* xi = xr + spectrum;
+                    const float* wr = W + ((long)o * in_channels + c) * 2 * spectrum;
+                    const float* wi = wr + spectrum;
+                    // x * conj(w): correlation, as the spatial kernels compute
+                    CPU_SIMD
+                    for (long f = 0; f < spectrum; ++f) {
+                        yr[f] += xr[f] * wr[f] + xi[f] * wi[f];
+                        yi[f] += xi[f] * wr[f] - xr[f] * wi[f];
+                    }
+                }
+                fft_inverse_2d(yr, yi, Nh, Nw,
+                               output + ((long)(b0 + b) * out_channels + o) * out_h * out_w,
+                               out_h, out_w, scale, bias ? bias[o] : 0.0f);
+            }
+        }
+    }
+}
+
+// Channel-blocked direct convolution on NCHWc: channels are grouped in
+// blocks of nchwc_block, one SIMD vector, and each block is stored
+// [h][w][lane] so a pixel of the whole block is one vector. Filters are
+// reordered to [out block][in channel][ky][kx][lane], so every tap
+// broadcasts one input value against a vector of nchwc_block filters. A
+// register tile of nchwc_ro output blocks x nchwc_rx output positions stays
+// in accumulators over all in_channels * k * k taps: no column matrix, and
+// the filters of the output blocks being computed stay in cache while the
+// tile walks the image.
+#ifdef CPU_SCALAR
+const int nchwc_block = 8;
+const int nchwc_ro = 1;
+const int nchwc_rx = 4;
+#else
+const int nchwc_block = CPU_VECTOR_WIDTH;
+const int nchwc_ro = 2;
+const int nchwc_rx = CPU_VECTOR_WIDTH == 16 ? 6 : 4;   // 2 x nchwc_rx accumulators of the 32 or 16 vector registers
+#endif
+
+// One image, NCHW -> NCHWc with `padding` zeros around every channel. Lanes
+// past the last channel stay zero.
+void nchw_to_nchwc(const float* src, int channels, int height, int width, int padding, float* dst) {
+    int blocks = (channels + nchwc_block - 1) / nchwc_block;
+    int hp = height + 2 * padding, wp = width + 2 * padding;
+    memset(dst, 0, sizeof(float) * blocks * hp * wp * nchwc_block);
+    #pragma omp parallel for if((long)channels * height * width > parallel_threshold)
+    for (int c = 0; c < channels; ++c) {
+        float* block = dst + (long)c / nchwc_block * hp * wp * nchwc_block + c % nchwc_block;
+        for (int y = 0; y < height; ++y) {
+            const float* s = src + ((long)c * height + y) * width;
+            float* d = block + ((long)(y + padding) * wp + padding) * nchwc_block;
+            for (int x = 0; x < width; ++x)
+                d[x * nchwc_block] = s[x];
+        }
+    }
+}
+
+// One image, NCHWc -> NCHW, dropping the lanes past the last channel
+void nchwc_to_nchw(const float* src, int channels, int height, int width, float* dst) {
+    #pragma omp parallel for if((long)channels * height * width > parallel_threshold)
+    for (int c = 0; c < channels; ++c) {
+        const float* s = src + (long)c / nchwc_block * height * width * nchwc_block + c % nchwc_block;
+        float* d = dst + (long)c * height * width;
+        for (long i = 0; i < (long)height * width; ++i)
+            d[i] = s[i * nchwc_block];
+    }
+}
+
+// Filters as [out block][in channel][ky][kx][lane], missing output channels zero
+std::shared_ptr<const std::vector<float>> nchwc_filters(const float* weights, int out_channels, int in_channels,
+                                                        int kernel_size) {
+    int blocks = (out_channels + nchwc_block - 1) / nchwc_block;
+    long taps = (long)in_channels * kernel_size * kernel_size;
+    return cached_filters(weights, out_channels * taps * sizeof(float),
+                          {CONV_NCHWC, nchwc_block, 0, out_channels, in_channels, kernel_size}, [&] {
+        auto w = std::make_shared<std::vector<float>>((size_t)blocks * taps * nchwc_block, 0.0f);
+        for (int o = 0; o < out_channels; ++o)
+            for (long t = 0; t < taps; ++t)
+                (*w)[((long)o / nchwc_block * taps + t) * nchwc_block + o % nchwc_block] = weights[o * taps + t];
+        return w;
+    });
+}
+
+// RO output blocks x RX output positions of one row. `in` is the first input
+// pixel under the tile (lane 0 of channel block 0), `w` the filters of the
+// first output block, `out` the first output pixel.
+template <int RO, int RX>
+inline void nchwc_tile(const float* in, long in_block, int in_row, int stride, int in_channels, int kernel_size,
+                       const float* w, long w_block, const float* bias, float* out, long out_block) {
+    float acc[RO][RX][nchwc_block];
+    for (int ro = 0; ro < RO; ++ro)
+        for (int r = 0; r < RX; ++r)
+            for (int l = 0; l < nchwc_block; ++l)
+                acc[ro][r][l] = bias[ro * nchwc_block + l];
+    // Channel blocks outside, the lanes of a block innermost: a fixed trip
+    // count the compiler unrolls, with the input a contiguous run of lanes
+    long w_tap = (long)kernel_size * kernel_size * nchwc_block;
+    for (int c0 = 0; c0 < in_channels; c0 += nchwc_block) {
+        int lanes = std::min(nchwc_block, in_channels - c0);
+        const float* src = in + c0 / nchwc_block * in_block;
+        const float* wc = w + c0 * w_tap;
+        for (int ky = 0; ky < kernel_size; ++ky) {
+            for (int kx = 0; kx < kernel_size; ++kx) {
+                const float* px = src + ((long)ky * in_row + kx) * nchwc_block;
+                const float* wk = wc + (ky * kernel_size + kx) * nchwc_block;
+                for (int c = 0; c < lanes; ++c, wk += w_tap) {
+                    for (int r = 0; r < RX; ++r) {
+                        float v = px[r * stride * nchwc_block + c];
+                        for (int ro = 0; ro < RO; ++ro) {
+                            CPU_SIMD
+                            for (int l = 0; l < nchwc_block; ++l)
+                                acc[ro][r][l] += v * wk[ro * w_block + l];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (int ro = 0; ro < RO; ++ro)
+        for (int r = 0; r < RX; ++r)
+            for (int l = 0; l < nchwc_block; ++l)
+                out[ro * out_block + r * nchwc_block + l] = acc[ro][r][l];
+}
+
+// The last n < RX positions of a row as one narrower tile
+template <int RO, int RX>
+void nchwc_tail(int n, const float* in, long in_block, int in_row, int stride, int in_channels, int kernel_size,
+                const float* w, long w_block, const float* bias, float* out, long out_block) {
+    if constexpr (RX > 1) {
+        if (n < RX) {
+            nchwc_tail<RO, RX - 1>(n, in, in_block, in_row, stride, in_channels, kernel_size,
+                                   w, w_block, bias, out, out_block);
+            return;
+        }
+    }
+    nchwc_tile<RO, RX>(in, in_block, in_row, stride, in_channels, kernel_size, w, w_block, bias, out, out_block);
+}
+
+// One output row of RO output blocks, in tiles of nchwc_rx positions
+template <int RO>
+void nchwc_row(const float* in, long in_block, int in_row, int stride, int in_channels, int kernel_size,
+               const float* w, long w_block, const float* bias, float* out, long out_block, int out_w) {
+    int x = 0;
+    for (; x + nchwc_rx <= out_w; x += nchwc_rx)
+        nchwc_tile<RO, nchwc_rx>(in + (long)x * stride * nchwc_block, in_block, in_row, stride, in_channels,
+                                 kernel_size, w, w_block, bias, out + x * nchwc_block, out_block);
+    if (x < out_w)
+        nchwc_tail<RO, nchwc_rx - 1>(out_w - x, in + (long)x * stride * nchwc_block, in_block, in_row, stride,
+                                     in_channels, kernel_size, w, w_block, bias, out + x * nchwc_block, out_block);
+}
+
+// Any stride and padding. Images go one at a time through the reorders at
+// both ends, so the only buffers are one image in and out in NCHWc.
+void conv2d_nchwc(const float* input, const float* weights, const float* bias, float* output,
+                  int batch_size, int in_channels, int height, int width,
+                  int out_channels, int kernel_size, int stride, int padding, int out_h, int out_w) {
+    int in_blocks = (in_channels + nchwc_block - 1) / nchwc_block;
+    int out_blocks = (out_channels + nchwc_block - 1) / nchwc_block;
+    int in_row = width + 2 * padding;
+    long in_block = (long)(height + 2 * padding) * in_row * nchwc_block;
+    long out_block = (long)out_h * out_w * nchwc_block;
+    long w_block = (long)in_channels * kernel_size * kernel_size * nchwc_block;
+    auto filters = nchwc_filters(weights, out_channels, in_channels, kernel_size);
+    std::vector<float> block_bias((size_t)out_blocks * nchwc_block, 0.0f);
+    if (bias)
+        std::copy(bias, bias + out_channels, block_bias.begin());
+
+    thread_local std::vector<float> x_buffer, y_buffer;
+    float* X = gemm_workspace(x_buffer, (size_t)in_blocks * in_block);
+    float* Y = gemm_workspace(y_buffer, (size_t)out_blocks * out_block);
+    int groups = (out_blocks + nchwc_ro - 1) / nchwc_ro;
+    long work = (long)out_channels * out_h * out_w * in_channels * kernel_size * kernel_size;
+
+    for (int b = 0; b < batch_size; ++b) {
+        nchw_to_nchwc(input + (long)b * in_channels * height * width, in_channels, height, width, padding, X);
+        #pragma omp parallel for collapse(2) if(work > parallel_threshold)
+        for (int g = 0; g < groups; ++g) {
+            for (int y = 0; y < out_h; ++y) {
+                int ob = g * nchwc_ro;
+                const float* in = X + (long)y * stride * in_row * nchwc_block;
+                const float* w = filters->data() + ob * w_block;
+                const float* bb = block_bias.data() + ob * nchwc_block;
+                float* out = Y + ob * out_block + (long)y * out_w * nchwc_block;
+                if (ob + nchwc_ro <= out_blocks)
+                    nchwc_row<nchwc_ro>(in, in_block, in_row, stride, in_channels, kernel_size,
+                                        w, w_block, bb, out, out_block, out_w);
+                else
+                    nchwc_row<1>(in, in_block, in_row, stride, in_channels, kernel_size,
+                                 w, w_block, bb, out, out_block, out_w);
+            }
+        }
+        nchwc_to_nchw(Y, out_channels, out_h, out_w, output + (long)b * out_channels * out_h * out_w);
+    }
+}
+
+// Each image is one GEMM: output (out_channels x out_h*out_w) =
+// weights (out_channels x in_channels*k*k) * im2col(image), with the bias
+// added per output channel. The column buffer belongs to the calling thread
+// and is reused across calls and images.
+void conv2d_im2col(const float* input, const float* weights, const float* bias, float* output,
+                   int batch_size, int in_channels, int height, int width,
+                   int out_channels, int kernel_size, int stride, int padding, int out_h, int out_w) {
+    int K = in_channels * kernel_size * kernel_size;
+    int N = out_h * out_w;
+    // A 1x1 kernel without stride or padding already is its own column matrix
+    bool direct = kernel_size == 1 && stride == 1 && padding == 0;
+    thread_local std::vector<float> col_buffer;
+    float* col = direct ? nullptr : gemm_workspace(col_buffer, (size_t)K * N);
+
+    for (int b = 0; b < batch_size; ++b) {
+        const float* in = input + (long)b * in_channels * height * width;
+        float* out = output + (long)b * out_channels * N;
+        if (direct)
+            col = const_cast<float*>(in);
+        else
+            im2col(in, in_channels, height, width, kernel_size, stride, padding, out_h, out_w, col);
+
+        // Fewer filters than a micro-kernel tile: padding them up to gemm_mr
+        // rows would multiply the work, accumulate each filter row by row instead
+        if (out_channels < gemm_mr) {
+            long work = (long)out_channels * K * N;
+            #pragma omp parallel for if(work > parallel_threshold)
+            for (int o = 0; o < out_channels; ++o) {
+                const float* w = weights + (long)o * K;
+                float* y = out + (long)o * N;
+                float bias_val = bias ? bias[o] : 0.0f;
+                for (int n = 0; n < N; ++n)
+                    y[n] = bias_val;
+                for (int k = 0; k < K; ++k) {
+                    const float* x = col + (long)k * N;
+                    float wk = w[k];
+                    CPU_SIMD
+                    for (int n = 0; n < N; ++n)
+                        y[n] += wk * x[n];
+                }
+            }
+            continue;
+        }
+        gemm(false, false, out_channels, N, K, weights, K, col, N, out, N,
+             0.0f, bias, bias ? BIAS_PER_ROW : BIAS_NONE);
+    }
+}
+
+// Picks the algorithm for a layer: the requested one if it can run the
+// shape, otherwise by shape. FFT for unstrided layers whose k^2 work per
+// output outweighs the transforms (large kernels, large maps); Winograd for
+// 3x3 unstrided layers deep enough for its per-element GEMMs; the direct row
+// loop for unpadded layers with fewer filters than a tile; the NCHWc kernel
+// for the remaining spatial kernels once there are vectors to block for;
+// im2col + GEMM otherwise, 1x1 kernels included. Per image, so the batch
+// size does not enter: filter transforms are cached, and the per-image costs
+// measured the same ordering from 1 to 32 images.
+int conv2d_choose(int algo, int in_channels, int height, int width,
+                  int out_channels, int kernel_size, int stride, int padding, int out_h, int out_w) {
+    switch (algo) {
+    case CONV_DIRECT: if (stride == 1 && padding == 0) return algo; break;
+    case CONV_IM2COL: return algo;
+    case CONV_WINOGRAD: if (kernel_size == 3 && stride == 1) return algo; break;
+    case CONV_FFT: if (stride == 1) return algo; break;
+    case CONV_NCHWC: return algo;
+    }
+    if (stride == 1 && kernel_size >= 5) {
+        // Flops per image. The spatial kernels run several times closer to
+        // peak than the memory-bound transforms, hence the factor on the FFT side.
+        double spatial = 2.0 * out_channels * in_channels * kernel_size * kernel_size * out_h * out_w;
+        double n = (double)fft_size(height + 2 * padding) * fft_size(width + 2 * padding);
+        double fft = 5.0 * n * log2(n) * (in_channels + out_channels) + 4.0 * n * out_channels * in_channels;
+        if (fft * fft_penalty < spatial)
+            return CONV_FFT;
+    }
+    if (kernel_size == 3 && stride == 1 && in_channels >= 32 && out_channels >= gemm_mr)
+        return CONV_WINOGRAD;
+    if (stride == 1 && padding == 0 && out_channels < gemm_mr)
+        return CONV_DIRECT;
+    if (CPU_VECTOR_WIDTH > 1 && kernel_size > 1)
+        return CONV_NCHWC;
+    return CONV_IM2COL;
+}
+
+void conv2d_forward(float* input, float* weights, float* bias, float* output,
+                    int batch_size, int in_channels, int height, int width,
+                    int out_channels, int kernel_size, int stride, int padding, int algo) {
+    int out_h = (height + 2 * padding - kernel_size) / stride + 1;
+    int out_w = (width + 2 * padding - kernel_size) / stride + 1;
+
+    switch (conv2d_choose(algo, in_channels, height, width, out_channels,
+                          kernel_size, stride, padding, out_h, out_w)) {
+    case CONV_DIRECT:
+        for (int b = 0; b < batch_size; ++b)
+            conv2d_rows(input + (long)b * in_channels * height * width, weights, bias,
+                        output + (long)b * out_channels * out_h * out_w,
+                        in_channels, height, width, out_channels, kernel_size, out_h, out_w);
+        break;
+    case CONV_WINOGRAD:
+        // F(4x4) once the maps are big enough that its wider tiles are not mostly cropped
+        if (out_h >= 8 && out_w >= 8)
+            conv2d_winograd<4>(input, weights, bias, output, batch_size, in_channels, height, width,
+                               out_channels, padding, out_h, out_w);
+        else
+            conv2d_winograd<2>(input, weights, bias, output, batch_size, in_channels, height, width,
+                               out_channels, padding, out_h, out_w);
+        break;
+    case CONV_NCHWC:
+        conv2d_nchwc(input, weights, bias, output, batch_size, in_channels, height, width,
+                     out_channels, kernel_size, stride, padding, out_h, out_w);
+        break;
+    case CONV_FFT:
+        conv2d_fft(input, weights, bias, output, batch_size, in_channels, height, width,
+                   out_channels, kernel_size, padding, out_h, out_w);
+        break;
+    default:
+        conv2d_im2col(input, weights, bias, output, batch_size, in_channels, height, width,
+                      out_channels, kernel_size, stride, padding, out_h, out_w);
+    }
+}
+
+// Single channel, single image, valid convolution: the original entry point
+void convolution_forward(float* input, float* kernel, float* output,
+                         int input_width, int kernel_size, int output_width) {
+    if (!input || !kernel || !output) {
+        printf("Error: Null pointer detected!\n");
+        return;
+    }
+    if (output_width != input_width - kernel_size + 1) {
+        printf("Error: output_width %d does not match a valid %dx%d convolution of width %d\n",
+               output_width, kernel_size, kernel_size, input_width);
+        return;
+    }
+    conv2d_forward(input, kernel, nullptr, output, 1, 1, input_width, input_width, 1, kernel_size, 1, 0, CONV_AUTO);
+}
+
+void relu_backward(float* output, float* grad_output, float* grad_input, int size) {
+    #pragma omp parallel for if(size > parallel_threshold)
+    for (int i = 0; i < size; ++i)
+        grad_input[i] = output[i] > 0.0f ? grad_output[i] : 0.0f;
+}
+
+void softmax_cross_entropy_backward(float* probs, int* labels, float* grad,
+                                    int batch_size, int num_classes) {
+    float scale = 1.0f / batch_size;
+    for (int b = 0; b < batch_size; ++b) {
+        const float* p = probs + (long)b * num_classes;
+        float* g = grad + (long)b * num_classes;
+        CPU_SIMD
+        for (int c = 0; c < num_classes; ++c)
+            g[c] = p[c] * scale;
+        g[labels[b]] -= scale;
+    }
+}
+
+void softmax_cross_entropy(float* logits, int* labels, float* loss, int* predictions,
+                           float* grad, int batch_size, int num_classes) {
+    float scale = 1.0f / batch_size;
+    float total = 0.0f;
+
+    #pragma omp parallel for reduction(+:total) if((long)batch_size * num_classes > parallel_threshold)
+    for (int b = 0; b < batch_size; ++b) {
+        const float* x = logits + (long)b * num_classes;
+        int label = labels[b];
+
+        float max_val, sum;
+        softmax_row_stats(x, num_classes, max_val, sum);
+
+        // The first class holding the max, as a sequential argmax would pick
+        int best = 0;
+        while (best + 1 < num_classes && x[best] != max_val)
+            ++best;
+
+        // -log softmax(x)[label] without ever forming the probability
+        total += logf(sum) + max_val - x[label];
+        if (predictions)
+            predictions[b] = best;
+        if (grad) {
+            float* g = grad + (long)b * num_classes;
+            float inv = scale / sum;
+            CPU_SIMD
+            for (int c = 0; c < num_classes; ++c)
+                g[c] = cpu_expf(x[c] - max_val) * inv;
+            g[label] -= scale;
+        }
+    }
+    loss[0] = total * scale;
+}
+
+void sgd_update(float* params, float* grads, float learning_rate, int size) {
+    filter_cache_forget(params, (size_t)size * sizeof(float));
+    #pragma omp parallel for if(size > parallel_threshold)
+    for (int i = 0; i < size; ++i)
+        params[i] -= learning_rate * grads[i];
+}
+
+// "Device" memory is 64-byte aligned host memory and the copies are memcpy
+void* device_malloc(size_t size) {
+    // aligned_alloc wants a multiple of the alignment
+    void* ptr = aligned_alloc(64, (size + 63) / 64 * 64);
+    if (!ptr) {
+        printf("Error: could not allocate %zu bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void device_free(void* ptr) {
+    if (ptr)
+        filter_cache_forget(ptr, malloc_usable_size(ptr));
+    free(ptr);
+}
+
+void copy_to_device(void* dest, void* src, size_t size) {
+    filter_cache_forget(dest, size);
+    memcpy(dest, src, size);
+}
+
+void copy_to_host(void* dest, void* src, size_t size) {
+    if (!dest || !src) {
+        printf("Error: Null pointer in copy_to_host (dest: %p, src: %p)\n", dest, src);
+        return;
+    }
+    memcpy(dest, src, size);
+}
@@ -1,9 +1,22 @@
 #include <zlib.h>
+#include <algorithm>
 #include <vector>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <stdexcept>
+#include <cstring>
 #include <byteswap.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "data_loader.h"
+#include "gz_index.h"
+
+// Decompressed bytes per gzread call, and zlib's own input buffer size
+const size_t read_chunk = 1 << 20;
+const unsigned gz_buffer = 1 << 18;
 
 // Read 4 bytes from gzip file and swap endianness
 int32_t read_int32(gzFile file) {
@@ -14,9 +27,58 @@ int32_t read_int32(gzFile file) {
     return bswap_32(value);
 }
 
-std::vector<float> load_mnist_images(const std::string& path, int& num_images, int& rows, int& cols) {
+// Bytes done out of the total and the decompression rate, on one line of
+// stderr that is redrawn while stderr is a terminal, then a summary line
+class LoadProgress {
+public:
+    LoadProgress(const std::string& path, size_t total)
+        : path_(path), total_(total), interactive_(isatty(STDERR_FILENO)),
+          start_(std::chrono::steady_clock::now()), last_(start_) {}
+
+    void update(size_t done) {
+        if (!interactive_)
+            return;
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_ < std::chrono::milliseconds(100))
+            return;
+        last_ = now;
+        fprintf(stderr, "\rLoading %s: %.1f / %.1f MB (%.0f MB/s)", path_.c_str(),
+                done / 1e6, total_ / 1e6, done / 1e6 / seconds(now));
+    }
+
+    void finish(size_t count, const char* what) {
+        double s = seconds(std::chrono::steady_clock::now());
+        fprintf(stderr, "%sLoaded %zu %s from %s in %.2f s (%.0f MB/s)\n", interactive_ ? "\r\033[K" : "",
+                count, what, path_.c_str(), s, total_ / 1e6 / (s > 0 ? s : 1e-9));
+    }
+
+private:
+    double seconds(std::chrono::steady_clock::time_point now) const {
+        return std::chrono::duration<double>(now - start_).count();
+    }
+
+    std::string path_;
+    size_t total_;
+    bool interactive_;
+    std::chrono::steady_clock::time_point start_, last_;
+};
+
+// Decompresses `size` bytes into dst, read_chunk bytes per gzread call
+static void read_bytes(gzFile file, unsigned char* dst, size_t size, LoadProgress& progress) {
+    for (size_t done = 0; done < size;) {
+        unsigned want = (unsigned)std::min(size - done, read_chunk);
+        if (gzread(file, dst + done, want) != (int)want) {
+            throw std::runtime_error("Unexpected end of file");
+        }
+        done += want;
+        progress.update(done);
+    }
+}
+
+std::vector<unsigned char> load_mnist_pixels(const std::string& path, int& num_images, int& rows, int& cols) {
     gzFile file = gzopen(path.c_str(), "rb");
     if (!file) throw std::runtime_error("Could not open file: " + path);
+    gzbuffer(file, gz_buffer);
 
     try {
         int magic_number = read_int32(file);
@@ -24,52 +86,278 @@ std::vector<float> load_mnist_images(const std::string& path, int& num_images, i
         rows = read_int32(file);
         cols = read_int32(file);
 
-        if (magic_number != 2051) {
+        if (magic_number != 2051 || num_images < 0 || rows < 0 || cols < 0) {
             throw std::runtime_error("Invalid MNIST image file format");
         }
 
-        std::vector<float> images(num_images * rows * cols);
-        unsigned char pixel;
-        for (size_t i = 0; i < images.size(); ++i) {
-            if (gzread(file, &pixel, 1) != 1) {
-                throw std::runtime_error("Unexpected end of file");
-            }
-            images[i] = static_cast<float>(pixel) / 255.0f;
-        }
+        size_t size = (size_t)num_images * rows * cols;
+        std::vector<unsigned char> pixels(size);
+        LoadProgress progress(path, size);
+        read_bytes(file, pixels.data(), size, progress);
+        progress.finish(num_images, "images");
 
         gzclose(file);
-        return images;
+        return pixels;
     } catch (...) {
         gzclose(file);
         throw;
     }
 }
 
+std::vector<float> load_mnist_images(const std::string& path, int& num_images, int& rows, int& cols) {
+    std::vector<unsigned char> pixels = load_mnist_pixels(path, num_images, rows, cols);
+    std::vector<float> images(pixels.size());
+    // Plain loop over contiguous bytes, the compiler vectorizes the widening
+    // and the divide
+    for (size_t i = 0; i < pixels.size(); ++i)
+        images[i] = static_cast<float>(pixels[i]) / 255.0f;
+    return images;
+}
+
 std::vector<int> load_mnist_labels(const std::string& path, int& num_labels) {
     gzFile file = gzopen(path.c_str(), "rb");
     if (!file) throw std::runtime_error("Could not open file: " + path);
+    gzbuffer(file, gz_buffer);
 
     try {
         int magic_number = read_int32(file);
         num_labels = read_int32(file);
 
-        if (magic_number != 2049) {
+        if (magic_number != 2049 || num_labels < 0) {
             throw std::runtime_error("Invalid MNIST label file format");
         }
 
-        std::vector<int> labels(num_labels);
-        unsigned char label;
-        for (int i = 0; i < num_labels; ++i) {
-            if (gzread(file, &label, 1) != 1) {
-                throw std::runtime_error("Unexpected end of file");
-            }
-            labels[i] = static_cast<int>(label);
-        }
+        std::vector<unsigned char> bytes(num_labels);
+        LoadProgress progress(path, num_labels);
+        read_bytes(file, bytes.data(), bytes.size(), progress);
+        progress.finish(num_labels, "labels");
 
         gzclose(file);
-        return labels;
+        return std::vector<int>(bytes.begin(), bytes.end());
     } catch (...) {
         gzclose(file);
         throw;
     }
-}
\ No newline at end of file
+}
+
+// Big-endian int32 header fields at the start of an IDX file
+static void read_idx_header(const GzIndex& index, int32_t* fields, int count) {
+    if (index.uncompressed_size() < count * sizeof(int32_t)) {
+        throw std::runtime_error("Unexpected end of file");
+    }
+    index.read(0, reinterpret_cast<unsigned char*>(fields), count * sizeof(int32_t));
+    for (int i = 0; i < count; ++i)
+        fields[i] = bswap_32(fields[i]);
+}
+
+static void check_range(int first, int count, int total, const std::string& path) {
+    if (first < 0 || count < 0 || first > total - count) {
+        throw std::runtime_error("Records " + std::to_string(first) + "+" + std::to_string(count)
+                                 + " out of range: " + path);
+    }
+}
+
+std::vector<unsigned char> load_mnist_pixels(const std::string& path, int first, int count,
+                                             int& num_images, int& rows, int& cols) {
+    GzIndex index(path);
+    int32_t header[4];
+    read_idx_header(index, header, 4);
+    num_images = header[1];
+    rows = header[2];
+    cols = header[3];
+    if (header[0] != 2051 || num_images < 0 || rows < 0 || cols < 0) {
+        throw std::runtime_error("Invalid MNIST image file format");
+    }
+    check_range(first, count, num_images, path);
+
+    size_t image_size = (size_t)rows * cols;
+    std::vector<unsigned char> pixels(count * image_size);
+    LoadProgress progress(path, pixels.size());
+    index.read(sizeof(header) + first * image_size, pixels.data(), pixels.size());
+    progress.finish(count, "images");
+    return pixels;
+}
+
+std::vector<float> load_mnist_images(const std::string& path, int first, int count,
+                                     int& num_images, int& rows, int& cols) {
+    std::vector<unsigned char> pixels = load_mnist_pixels(path, first, count, num_images, rows, cols);
+    std::vector<float> images(pixels.size());
+    for (size_t i = 0; i < pixels.size(); ++i)
+        images[i] = static_cast<float>(pixels[i]) / 255.0f;
+    return images;
+}
+
+std::vector<int> load_mnist_labels(const std::string& path, int first, int count, int& num_labels) {
+    GzIndex index(path);
+    int32_t header[2];
+    read_idx_header(index, header, 2);
+    num_labels = header[1];
+    if (header[0] != 2049 || num_labels < 0) {
+        throw std::runtime_error("Invalid MNIST label file format");
+    }
+    check_range(first, count, num_labels, path);
+
+    std::vector<unsigned char> bytes(count);
+    LoadProgress progress(path, bytes.size());
+    index.read(sizeof(header) + first, bytes.data(), bytes.size());
+    progress.finish(count, "labels");
+    return std::vector<int>(bytes.begin(), bytes.end());
+}
+
+// Dataset cache: a header, then the images as 8-bit pixels and the labels
+// as ints, each starting on a cache_alignment boundary so the mapped arrays
+// can be used in place
+const char cache_magic[8] = {'M', 'N', 'I', 'S', 'T', 'C', 'A', 'C'};
+const uint32_t cache_version = 2;     // 1 stored the images as floats
+const size_t cache_alignment = 64;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_crc;        // crc32 of this header with header_crc = 0
+    int32_t num_images, rows, cols, num_labels;
+    int64_t images_mtime;       // of the sources, in ns
+    int64_t labels_mtime;
+    uint64_t images_offset, images_bytes;
+    uint64_t labels_offset, labels_bytes;
+    uint32_t data_crc;          // crc32 of the images then the labels
+    uint32_t reserved;
+};
+
+static size_t align_up(size_t n) {
+    return (n + cache_alignment - 1) / cache_alignment * cache_alignment;
+}
+
+static long long mtime_ns(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) throw std::runtime_error("Could not open file: " + path);
+    return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+static uint32_t header_crc(CacheHeader header) {
+    header.header_crc = 0;
+    return crc32_z(0, reinterpret_cast<const Bytef*>(&header), sizeof(header));
+}
+
+static uint32_t data_crc(const void* images, size_t images_bytes, const void* labels, size_t labels_bytes) {
+    uLong crc = crc32_z(0, static_cast<const Bytef*>(images), images_bytes);
+    return crc32_z(crc, static_cast<const Bytef*>(labels), labels_bytes);
+}
+
+// Writes the cache next to its final name and renames it into place.
+// Returns false, leaving nothing behind, if any step fails.
+static bool write_cache(const std::string& path, const CacheHeader& header, const unsigned char* images,
+                        const int* labels) {
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) return false;
+    std::vector<char> padding(cache_alignment, 0);
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(padding.data(), 1, header.images_offset - sizeof(header), fp) == header.images_offset - sizeof(header)
+        && fwrite(images, 1, header.images_bytes, fp) == header.images_bytes
+        && fwrite(padding.data(), 1, header.labels_offset - header.images_offset - header.images_bytes, fp)
+               == header.labels_offset - header.images_offset - header.images_bytes
+        && fwrite(labels, 1, header.labels_bytes, fp) == header.labels_bytes;
+    ok = fclose(fp) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+}
+
+// Maps the cache at `path` if it is complete, intact and current: its
+// recorded source mtimes must match, and both checksums must hold
+bool MnistDataset::map_cache(const std::string& path, long long images_mtime, long long labels_mtime) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheHeader))
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    size_t size = st.st_size;
+    const char* base = static_cast<const char*>(map);
+    CacheHeader h;
+    memcpy(&h, base, sizeof(h));
+    bool valid = memcmp(h.magic, cache_magic, sizeof(cache_magic)) == 0
+        && h.version == cache_version && h.header_crc == header_crc(h)
+        && h.images_mtime == images_mtime && h.labels_mtime == labels_mtime
+        && h.num_images >= 0 && h.num_images == h.num_labels && h.rows >= 0 && h.cols >= 0
+        && h.images_bytes == (uint64_t)h.num_images * h.rows * h.cols
+        && h.labels_bytes == (uint64_t)h.num_labels * sizeof(int)
+        && h.images_offset % cache_alignment == 0 && h.labels_offset % cache_alignment == 0
+        && h.images_offset + h.images_bytes <= size && h.labels_offset + h.labels_bytes <= size;
+    // Reading every page for the checksum also brings them into the page
+    // cache ahead of the first epoch
+    if (valid) {
+        madvise(map, size, MADV_WILLNEED);
+        valid = h.data_crc == data_crc(base + h.images_offset, h.images_bytes, base + h.labels_offset, h.labels_bytes);
+    }
+    if (!valid) {
+        munmap(map, size);
+        return false;
+    }
+
+    mapping_ = map;
+    mapping_size_ = size;
+    num_images = h.num_images;
+    rows = h.rows;
+    cols = h.cols;
+    images = {reinterpret_cast<const unsigned char*>(base + h.images_offset), h.images_bytes};
+    labels = {reinterpret_cast<const int*>(base + h.labels_offset), h.labels_bytes / sizeof(int)};
+    return true;
+}
+
+MnistDataset::MnistDataset(const std::string& images_path, const std::string& labels_path) {
+    std::string cache = images_path + ".cache";
+    long long images_mtime = mtime_ns(images_path);
+    long long labels_mtime = mtime_ns(labels_path);
+    auto start = std::chrono::steady_clock::now();
+    if (map_cache(cache, images_mtime, labels_mtime)) {
+        fprintf(stderr, "Mapped %d images from %s in %.2f s\n", num_images, cache.c_str(),
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return;
+    }
+
+    int num_labels;
+    owned_images_ = load_mnist_pixels(images_path, num_images, rows, cols);
+    owned_labels_ = load_mnist_labels(labels_path, num_labels);
+    if (num_labels != num_images) {
+        throw std::runtime_error("Image and label counts differ: " + images_path + ", " + labels_path);
+    }
+
+    CacheHeader h = {};
+    memcpy(h.magic, cache_magic, sizeof(cache_magic));
+    h.version = cache_version;
+    h.num_images = num_images;
+    h.rows = rows;
+    h.cols = cols;
+    h.num_labels = num_labels;
+    h.images_mtime = images_mtime;
+    h.labels_mtime = labels_mtime;
+    h.images_offset = align_up(sizeof(h));
+    h.images_bytes = owned_images_.size();
+    h.labels_offset = align_up(h.images_offset + h.images_bytes);
+    h.labels_bytes = owned_labels_.size() * sizeof(int);
+    h.data_crc = data_crc(owned_images_.data(), h.images_bytes, owned_labels_.data(), h.labels_bytes);
+    h.header_crc = header_crc(h);
+
+    // From now on the data comes from the mapped cache, shared with every
+    // other job reading it; the heap copy only stays if that fails
+    if (write_cache(cache, h, owned_images_.data(), owned_labels_.data())
+        && map_cache(cache, images_mtime, labels_mtime)) {
+        fprintf(stderr, "Wrote %s\n", cache.c_str());
+        owned_images_ = std::vector<unsigned char>();
+        owned_labels_ = std::vector<int>();
+        return;
+    }
+    fprintf(stderr, "Could not write %s, keeping the dataset in memory\n", cache.c_str());
+    images = {owned_images_.data(), owned_images_.size()};
+    labels = {owned_labels_.data(), owned_labels_.size()};
+}
+
+MnistDataset::~MnistDataset() {
+    if (mapping_)
+        munmap(mapping_, mapping_size_);
+}
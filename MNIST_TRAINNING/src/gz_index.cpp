@@ -0,0 +1,242 @@
+#include <zlib.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gz_index.h"
+
+// History inflate needs to resume mid-stream, and the compressed bytes
+// read per fread call
+const unsigned window_size = 32768;
+const size_t input_chunk = 1 << 18;
+
+// Index file: a header, the points, then their windows
+const char index_magic[8] = {'M', 'N', 'I', 'S', 'T', 'G', 'Z', 'X'};
+const uint32_t index_version = 1;
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_crc;        // crc32 of this header with header_crc = 0
+    int64_t source_mtime;       // in ns
+    int64_t source_size;
+    uint64_t uncompressed_size;
+    uint64_t span;
+    uint64_t points;
+    uint32_t data_crc;          // crc32 of the points then the windows
+    uint32_t reserved;
+};
+
+static uint32_t header_crc(IndexHeader header) {
+    header.header_crc = 0;
+    return crc32_z(0, reinterpret_cast<const Bytef*>(&header), sizeof(header));
+}
+
+static uint32_t data_crc(const void* points, size_t points_bytes, const void* windows, size_t windows_bytes) {
+    uLong crc = crc32_z(0, static_cast<const Bytef*>(points), points_bytes);
+    return crc32_z(crc, static_cast<const Bytef*>(windows), windows_bytes);
+}
+
+// Closes the file however the scope is left
+struct FileCloser {
+    FILE* fp;
+    ~FileCloser() { if (fp) fclose(fp); }
+};
+
+struct InflateEnd {
+    z_stream* strm;
+    ~InflateEnd() { inflateEnd(strm); }
+};
+
+GzIndex::GzIndex(const std::string& path, size_t span) : path_(path), span_(span) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) throw std::runtime_error("Could not open file: " + path);
+    long long mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    long long size = st.st_size;
+
+    unsigned char id[2] = {0, 0};
+    FileCloser f{fopen(path.c_str(), "rb")};
+    if (!f.fp) throw std::runtime_error("Could not open file: " + path);
+    if (fread(id, 1, 2, f.fp) != 2 || id[0] != 0x1f || id[1] != 0x8b) {
+        compressed_ = false;
+        uncompressed_size_ = size;
+        return;
+    }
+
+    std::string index_path = path + ".gzidx";
+    if (load(index_path, mtime, size))
+        return;
+    build();
+    if (!save(index_path, mtime, size))
+        fprintf(stderr, "Could not write %s, keeping the index in memory\n", index_path.c_str());
+}
+
+// One pass over the whole stream, adding a point at the end of a deflate
+// block once `span` bytes have come out since the last one. Output goes
+// round a 32 KB ring so the window before each point is at hand.
+void GzIndex::build() {
+    FileCloser f{fopen(path_.c_str(), "rb")};
+    if (!f.fp) throw std::runtime_error("Could not open file: " + path_);
+    z_stream strm = {};
+    // 15-bit window, +32 to accept the gzip header
+    if (inflateInit2(&strm, 47) != Z_OK) throw std::runtime_error("inflateInit2 failed");
+    InflateEnd end{&strm};
+
+    std::vector<unsigned char> input(input_chunk), window(window_size, 0);
+    points_.clear();
+    windows_.clear();
+    uint64_t total_in = 0, total_out = 0, last = 0;
+    int ret = Z_OK;
+    strm.avail_out = 0;
+    do {
+        strm.avail_in = fread(input.data(), 1, input.size(), f.fp);
+        if (ferror(f.fp) || strm.avail_in == 0) throw std::runtime_error("Unexpected end of file: " + path_);
+        strm.next_in = input.data();
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = window_size;
+                strm.next_out = window.data();
+            }
+            total_in += strm.avail_in;
+            total_out += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            total_in -= strm.avail_in;
+            total_out -= strm.avail_out;
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+                throw std::runtime_error("Corrupt gzip data: " + path_);
+            if (ret == Z_STREAM_END)
+                break;
+            // data_type bit 7: stopped at a block boundary, bit 6: after the
+            // last block, bits 0-2: unused bits in the last byte read
+            bool boundary = (strm.data_type & 128) && !(strm.data_type & 64);
+            if (boundary && (total_out == 0 || total_out - last > span_)) {
+                points_.push_back({total_out, total_in, strm.data_type & 7, 0});
+                // The ring holds the last 32 KB out of order: the oldest
+                // bytes start where inflate will write next
+                size_t left = strm.avail_out, base = windows_.size();
+                windows_.resize(base + window_size);
+                memcpy(&windows_[base], window.data() + window_size - left, left);
+                memcpy(&windows_[base + left], window.data(), window_size - left);
+                last = total_out;
+            }
+        } while (strm.avail_in != 0);
+    } while (ret != Z_STREAM_END);
+    uncompressed_size_ = total_out;
+}
+
+void GzIndex::read(size_t offset, unsigned char* dst, size_t size) const {
+    if (offset + size > uncompressed_size_ || offset + size < offset)
+        throw std::runtime_error("Read past the end of " + path_);
+    if (size == 0)
+        return;
+    FileCloser f{fopen(path_.c_str(), "rb")};
+    if (!f.fp) throw std::runtime_error("Could not open file: " + path_);
+    if (!compressed_) {
+        if (fseeko(f.fp, offset, SEEK_SET) != 0 || fread(dst, 1, size, f.fp) != size)
+            throw std::runtime_error("Unexpected end of file: " + path_);
+        return;
+    }
+
+    // Last point at or before the offset
+    auto it = std::upper_bound(points_.begin(), points_.end(), (uint64_t)offset,
+                               [](uint64_t o, const Point& p) { return o < p.out; });
+    if (it == points_.begin()) throw std::runtime_error("Corrupt gzip index: " + path_);
+    const Point& here = *--it;
+
+    z_stream strm = {};
+    // Raw deflate, the point is past the gzip header
+    if (inflateInit2(&strm, -15) != Z_OK) throw std::runtime_error("inflateInit2 failed");
+    InflateEnd end{&strm};
+    if (fseeko(f.fp, here.in - (here.bits ? 1 : 0), SEEK_SET) != 0)
+        throw std::runtime_error("Unexpected end of file: " + path_);
+    if (here.bits) {
+        int c = getc(f.fp);
+        if (c == EOF) throw std::runtime_error("Unexpected end of file: " + path_);
+        inflatePrime(&strm, here.bits, c >> (8 - here.bits));
+    }
+    inflateSetDictionary(&strm, &windows_[(it - points_.begin()) * window_size], window_size);
+
+    // Inflate and drop the bytes from the point up to the offset, then
+    // inflate straight into dst
+    std::vector<unsigned char> input(input_chunk), discard(window_size);
+    strm.avail_in = 0;
+    auto inflate_into = [&](unsigned char* out, unsigned n) {
+        strm.next_out = out;
+        strm.avail_out = n;
+        while (strm.avail_out != 0) {
+            if (strm.avail_in == 0) {
+                strm.avail_in = fread(input.data(), 1, input.size(), f.fp);
+                if (ferror(f.fp) || strm.avail_in == 0)
+                    throw std::runtime_error("Unexpected end of file: " + path_);
+                strm.next_in = input.data();
+            }
+            int ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+                throw std::runtime_error("Corrupt gzip data: " + path_);
+            if (ret == Z_STREAM_END && strm.avail_out != 0)
+                throw std::runtime_error("Unexpected end of file: " + path_);
+        }
+    };
+    for (size_t skip = offset - here.out; skip > 0;) {
+        unsigned n = (unsigned)std::min<size_t>(skip, window_size);
+        inflate_into(discard.data(), n);
+        skip -= n;
+    }
+    // avail_out is 32-bit, so long reads go in pieces
+    for (size_t done = 0; done < size;) {
+        unsigned n = (unsigned)std::min<size_t>(size - done, 1u << 30);
+        inflate_into(dst + done, n);
+        done += n;
+    }
+}
+
+bool GzIndex::load(const std::string& index_path, long long mtime, long long size) {
+    FileCloser f{fopen(index_path.c_str(), "rb")};
+    if (!f.fp) return false;
+    IndexHeader h;
+    if (fread(&h, sizeof(h), 1, f.fp) != 1) return false;
+    if (memcmp(h.magic, index_magic, sizeof(index_magic)) != 0 || h.version != index_version
+        || h.header_crc != header_crc(h) || h.source_mtime != mtime || h.source_size != size
+        || h.points == 0 || h.points > (uint64_t)size)
+        return false;
+
+    std::vector<Point> points(h.points);
+    std::vector<unsigned char> windows(h.points * window_size);
+    if (fread(points.data(), sizeof(Point), points.size(), f.fp) != points.size()
+        || fread(windows.data(), 1, windows.size(), f.fp) != windows.size()
+        || h.data_crc != data_crc(points.data(), points.size() * sizeof(Point), windows.data(), windows.size()))
+        return false;
+
+    points_.swap(points);
+    windows_.swap(windows);
+    uncompressed_size_ = h.uncompressed_size;
+    return true;
+}
+
+// Writes the index next to its final name and renames it into place.
+// Returns false, leaving nothing behind, if any step fails.
+bool GzIndex::save(const std::string& index_path, long long mtime, long long size) const {
+    IndexHeader h = {};
+    memcpy(h.magic, index_magic, sizeof(index_magic));
+    h.version = index_version;
+    h.source_mtime = mtime;
+    h.source_size = size;
+    h.uncompressed_size = uncompressed_size_;
+    h.span = span_;
+    h.points = points_.size();
+    h.data_crc = data_crc(points_.data(), points_.size() * sizeof(Point), windows_.data(), windows_.size());
+    h.header_crc = header_crc(h);
+
+    std::string tmp = index_path + ".tmp." + std::to_string(getpid());
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1
+        && fwrite(points_.data(), sizeof(Point), points_.size(), fp) == points_.size()
+        && fwrite(windows_.data(), 1, windows_.size(), fp) == windows_.size();
+    ok = fclose(fp) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), index_path.c_str()) == 0;
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+}
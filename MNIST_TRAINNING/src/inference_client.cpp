@@ -0,0 +1,72 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "inference_client.h"
+#include "network.h"
+
+bool read_full(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        // MSG_NOSIGNAL: a peer that went away is an error return, not SIGPIPE
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+InferenceClient::InferenceClient(const std::string& socket_path) : path_(socket_path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path too long: " + socket_path);
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0) throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    if (connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::string error = strerror(errno);
+        close(fd_);
+        throw std::runtime_error("Could not connect to " + socket_path + ": " + error);
+    }
+}
+
+InferenceClient::~InferenceClient() {
+    close(fd_);
+}
+
+void InferenceClient::predict(const float* images, int count, float* probs) {
+    if (count < 1 || (uint32_t)count > max_request_images) throw std::runtime_error("Request size out of range");
+    InferenceHeader request = {inference_request_magic, INFERENCE_OK, (uint32_t)count, 0};
+    InferenceHeader reply;
+    if (!write_full(fd_, &request, sizeof(request))
+        || !write_full(fd_, images, (size_t)count * Network::input_size * sizeof(float))
+        || !read_full(fd_, &reply, sizeof(reply))) {
+        throw std::runtime_error("Lost the connection to " + path_);
+    }
+    if (reply.magic != inference_reply_magic || reply.status != INFERENCE_OK || reply.count != (uint32_t)count) {
+        throw std::runtime_error("Server at " + path_ + " failed the request (status "
+                                 + std::to_string(reply.status) + ")");
+    }
+    if (!read_full(fd_, probs, (size_t)count * Network::num_classes * sizeof(float)))
+        throw std::runtime_error("Lost the connection to " + path_);
+}
@@ -1,10 +1,15 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <cstdlib>
 #include <ctime>
+#include <thread>
+#include "batch_prefetcher.h"
 #include "data_loader.h"
+#include "backend.h"
 #include "kernels.h"
 #include "memory.h"
+#include "model_file.h"
 #include "utils.h"
 
 // Network parameters
@@ -13,6 +18,7 @@ const int hidden_size = 128;
 const int num_classes = 10;
 const int batch_size = 100;
 const float learning_rate = 0.01f;
+const int epochs = 10;
 
 // Initialize weights and biases
 void initialize_weights(float* weights, int size) {
@@ -23,16 +29,18 @@ void initialize_weights(float* weights, int size) {
 
 int main() {
     std::srand(std::time(0));
+    print_backend(active_backend());
 
-    // Load MNIST data
-    int num_images, rows, cols, num_labels;
-    std::vector<float> images = load_mnist_images("data/train-images-idx3-ubyte.gz", num_images, rows, cols);
-    std::vector<int> labels = load_mnist_labels("data/train-labels-idx1-ubyte.gz", num_labels);
+    // Load MNIST data, mapped from the decoded cache after the first run
+    MnistDataset train("data/train-images-idx3-ubyte.gz", "data/train-labels-idx1-ubyte.gz");
+    int num_images = train.num_images;
 
     // Allocate device memory, this uses Nvedia GPU memory so keep an eye on your other sotwares usage
+    // The batch travels as 8-bit pixels and is scaled to floats on the device
+    unsigned char* d_pixels = static_cast<unsigned char*>(cuda_malloc(batch_size * input_size));
     float* d_input = static_cast<float*>(cuda_malloc(batch_size * input_size * sizeof(float)));
-    float* d_hidden = static_cast<float*>(cuda_malloc(hidden_size * sizeof(float)));
-    float* d_output = static_cast<float*>(cuda_malloc(num_classes * sizeof(float)));
+    float* d_hidden = static_cast<float*>(cuda_malloc(batch_size * hidden_size * sizeof(float)));
+    float* d_output = static_cast<float*>(cuda_malloc(batch_size * num_classes * sizeof(float)));
 
     // Initialize weights and biases mem
     float* fc1_weights = static_cast<float*>(cuda_malloc(input_size * hidden_size * sizeof(float)));
@@ -40,6 +48,17 @@ int main() {
     float* fc2_weights = static_cast<float*>(cuda_malloc(hidden_size * num_classes * sizeof(float)));
     float* fc2_bias = static_cast<float*>(cuda_malloc(num_classes * sizeof(float)));
 
+    // Backward pass: labels of the batch, activation gradients and parameter gradients
+    int* d_labels = static_cast<int*>(cuda_malloc(batch_size * sizeof(int)));
+    int* d_predictions = static_cast<int*>(cuda_malloc(batch_size * sizeof(int)));
+    float* d_loss = static_cast<float*>(cuda_malloc(sizeof(float)));
+    float* d_grad_output = static_cast<float*>(cuda_malloc(batch_size * num_classes * sizeof(float)));
+    float* d_grad_hidden = static_cast<float*>(cuda_malloc(batch_size * hidden_size * sizeof(float)));
+    float* fc1_weights_grad = static_cast<float*>(cuda_malloc(input_size * hidden_size * sizeof(float)));
+    float* fc1_bias_grad = static_cast<float*>(cuda_malloc(hidden_size * sizeof(float)));
+    float* fc2_weights_grad = static_cast<float*>(cuda_malloc(hidden_size * num_classes * sizeof(float)));
+    float* fc2_bias_grad = static_cast<float*>(cuda_malloc(num_classes * sizeof(float)));
+
     std::vector<float> h_fc1_weights(input_size * hidden_size);
     std::vector<float> h_fc1_bias(hidden_size);
     std::vector<float> h_fc2_weights(hidden_size * num_classes);
@@ -56,40 +75,70 @@ int main() {
     copy_to_device(fc2_weights, h_fc2_weights.data(), h_fc2_weights.size() * sizeof(float));
     copy_to_device(fc2_bias, h_fc2_bias.data(), h_fc2_bias.size() * sizeof(float));
 
+    // Batches are shuffled and gathered on background threads while the
+    // current one trains. NN_AUGMENT=1 distorts every image on the way
+    // (augment.h), using a quarter of the cores next to the kernels.
+    const char* augment_env = getenv("NN_AUGMENT");
+    bool augment = augment_env && atoi(augment_env) != 0;
+    AugmentConfig augment_config;
+    int workers = augment ? std::max(1u, std::thread::hardware_concurrency() / 4) : 1;
+    BatchPrefetcher prefetcher(train, batch_size, epochs, std::rand(), std::max(3, 2 * workers), workers,
+                               augment ? &augment_config : nullptr);
+
     // Training loop
-    for (int epoch = 0; epoch < 10; ++epoch) {
+    for (int epoch = 0; epoch < epochs; ++epoch) {
         float total_loss = 0.0f;
         int correct = 0;
+        int batches = 0;
+        std::vector<int> host_predictions(batch_size);
+
+        for (int step = 0; step < prefetcher.batches(); ++step) {
+            const Batch* batch = prefetcher.next();
+            // The last batch may be short
+            int n = batch->size;
 
-        for (int i = 0; i < num_images; i += batch_size) {
-            // Copy batch to device
-            copy_to_device(d_input, &images[i * input_size], batch_size * input_size * sizeof(float));
+            // Copy batch to device and scale it to [0, 1]
+            copy_to_device(d_pixels, batch->pixels, n * input_size);
+            pixels_to_float(d_pixels, d_input, 1.0f / 255.0f, 0.0f, n * input_size);
 
-            // Forward pass
+            // Forward pass, every layer processes the whole batch at once
             // Layer 1: Fully connected + ReLU
-            fc_forward(d_input, fc1_weights, fc1_bias, d_hidden, input_size, hidden_size);
-            relu_activation(d_hidden, d_hidden, hidden_size);
-
-            // Layer 2: Fully connected + Softmax
-            fc_forward(d_hidden, fc2_weights, fc2_bias, d_output, hidden_size, num_classes);
-            softmax(d_output, d_output, num_classes);
-
-            // Copy results to host
-            std::vector<float> host_output(num_classes * batch_size);
-            printf("Attempting to copy %zu bytes from device (%p) to host (%p)\n", 
-                num_classes * batch_size * sizeof(float), d_output, host_output.data());
-            copy_to_host(host_output.data(), d_output, num_classes * sizeof(float));
-
-            // Calculate loss and accuracy
-            total_loss += cross_entropy_loss(host_output.data(), &labels[i], batch_size, num_classes);
-            for (int j = 0; j < batch_size; ++j) {
-                int pred = argmax(&host_output[j * num_classes], num_classes);
-                if (pred == labels[i + j]) correct++;
+            fc_forward(d_input, fc1_weights, fc1_bias, d_hidden, n, input_size, hidden_size);
+            relu_activation(d_hidden, d_hidden, n * hidden_size);
+
+            // Layer 2: Fully connected, logits stay on the device
+            fc_forward(d_hidden, fc2_weights, fc2_bias, d_output, n, hidden_size, num_classes);
+
+            // Softmax + cross-entropy loss, predictions and the logits gradient in one kernel
+            copy_to_device(d_labels, batch->labels, n * sizeof(int));
+            softmax_cross_entropy(d_output, d_labels, d_loss, d_predictions, d_grad_output, n, num_classes);
+
+            // Backward pass
+            fc_backward(d_hidden, fc2_weights, d_grad_output, d_grad_hidden,
+                        fc2_weights_grad, fc2_bias_grad, n, hidden_size, num_classes);
+            relu_backward(d_hidden, d_grad_hidden, d_grad_hidden, n * hidden_size);
+            fc_backward(d_input, fc1_weights, d_grad_hidden, nullptr,
+                        fc1_weights_grad, fc1_bias_grad, n, input_size, hidden_size);
+
+            // SGD step
+            sgd_update(fc1_weights, fc1_weights_grad, learning_rate, input_size * hidden_size);
+            sgd_update(fc1_bias, fc1_bias_grad, learning_rate, hidden_size);
+            sgd_update(fc2_weights, fc2_weights_grad, learning_rate, hidden_size * num_classes);
+            sgd_update(fc2_bias, fc2_bias_grad, learning_rate, num_classes);
+
+            // Only the loss and the predicted classes come back to the host
+            float batch_loss;
+            copy_to_host(&batch_loss, d_loss, sizeof(float));
+            copy_to_host(host_predictions.data(), d_predictions, n * sizeof(int));
+            total_loss += batch_loss;
+            batches++;
+            for (int j = 0; j < n; ++j) {
+                if (host_predictions[j] == batch->labels[j]) correct++;
             }
         }
 
         std::cout << "Epoch " << epoch + 1 
-                  << " Loss: " << total_loss / (num_images / batch_size)
+                  << " Loss: " << total_loss / batches
                   << " Accuracy: " << (100.0f * correct / num_images) << "%\n";
 
         // Copying model parameters from device to host
@@ -98,17 +147,18 @@ int main() {
         copy_to_host(h_fc2_weights.data(), fc2_weights, h_fc2_weights.size() * sizeof(float));
         copy_to_host(h_fc2_bias.data(), fc2_bias, h_fc2_bias.size() * sizeof(float));
 
-        // Write to file
-        FILE* fp = fopen("mnist_model.bin", "wb");
-        fwrite(h_fc1_weights.data(), sizeof(float), h_fc1_weights.size(), fp);
-        fwrite(h_fc1_bias.data(), sizeof(float), h_fc1_bias.size(), fp);
-        fwrite(h_fc2_weights.data(), sizeof(float), h_fc2_weights.size(), fp);
-        fwrite(h_fc2_bias.data(), sizeof(float), h_fc2_bias.size(), fp);
-        fclose(fp);
+        // Write to file, weights are output x input as fc_forward takes them
+        save_model("mnist_model.bin", "fc-relu-fc", {
+            {"fc1.weight", {hidden_size, input_size}, h_fc1_weights.data()},
+            {"fc1.bias", {hidden_size}, h_fc1_bias.data()},
+            {"fc2.weight", {num_classes, hidden_size}, h_fc2_weights.data()},
+            {"fc2.bias", {num_classes}, h_fc2_bias.data()},
+        });
         printf("Model saved to mnist_model.bin\n");
     }
 
     // Cleanup mem
+    cuda_free(d_pixels);
     cuda_free(d_input);
     cuda_free(d_hidden);
     cuda_free(d_output);
@@ -116,6 +166,15 @@ int main() {
     cuda_free(fc1_bias);
     cuda_free(fc2_weights);
     cuda_free(fc2_bias);
+    cuda_free(d_labels);
+    cuda_free(d_predictions);
+    cuda_free(d_loss);
+    cuda_free(d_grad_output);
+    cuda_free(d_grad_hidden);
+    cuda_free(fc1_weights_grad);
+    cuda_free(fc1_bias_grad);
+    cuda_free(fc2_weights_grad);
+    cuda_free(fc2_bias_grad);
 
     return 0;
 }
@@ -0,0 +1,320 @@
+// Long-running inference daemon: keeps the model resident and answers
+// requests on a Unix socket (wire format in inference_client.h). Requests
+// arriving together are coalesced into one forward pass of up to
+// --max-batch images; the oldest queued request waits at most
+// --max-wait-us for others to join it, which bounds the added latency.
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "backend.h"
+#include "inference_client.h"
+#include "network.h"
+
+const int input_size = Network::input_size;
+const int num_classes = Network::num_classes;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+    stop_requested = 1;
+}
+
+// Queue between the connection threads and the one thread that runs the
+// network. A request larger than a batch is split across several.
+class Batcher {
+public:
+    Batcher(Network& net, int max_batch, std::chrono::microseconds max_wait)
+        : net_(net), max_batch_(max_batch), max_wait_(max_wait) {}
+
+    // Blocks until every image of the request has its probabilities.
+    // False if the server is stopping or the forward pass failed.
+    bool submit(const float* images, int count, float* probs) {
+        Request r{images, count, probs, 0, count, std::chrono::steady_clock::now(), false};
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_)
+                return false;
+            queue_.push_back(&r);
+            queued_ += count;
+            ++requests_;
+        }
+        arrived_.notify_one();
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return r.remaining == 0; });
+        return !r.failed;
+    }
+
+    // Runs batches until stop(), then drains what is still queued
+    void run() {
+        std::vector<float> input((size_t)max_batch_ * input_size), probs((size_t)max_batch_ * num_classes);
+        std::vector<Slice> slices;
+        for (;;) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            arrived_.wait(lock, [&] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty())
+                return;
+            // A full batch goes at once, otherwise whatever has arrived by the
+            // time the oldest request has waited max_wait
+            auto deadline = queue_.front()->arrival + max_wait_;
+            arrived_.wait_until(lock, deadline, [&] { return stopping_ || queued_ >= max_batch_; });
+
+            slices.clear();
+            int n = 0;
+            while (n < max_batch_ && !queue_.empty()) {
+                Request* r = queue_.front();
+                int take = std::min(r->count - r->taken, max_batch_ - n);
+                slices.push_back({r, r->taken, n, take});
+                r->taken += take;
+                n += take;
+                if (r->taken == r->count)
+                    queue_.pop_front();
+            }
+            queued_ -= n;
+            lock.unlock();
+
+            // Requests stay alive until their remaining count reaches zero,
+            // so their buffers are used without the lock
+            for (const Slice& s : slices) {
+                std::copy_n(s.request->images + (size_t)s.offset * input_size, (size_t)s.count * input_size,
+                            input.data() + (size_t)s.at * input_size);
+            }
+            bool ok = true;
+            try {
+                net_.predict(input.data(), n, probs.data());
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Error: %s\n", e.what());
+                ok = false;
+            }
+            for (const Slice& s : slices) {
+                std::copy_n(probs.data() + (size_t)s.at * num_classes, (size_t)s.count * num_classes,
+                            s.request->probs + (size_t)s.offset * num_classes);
+            }
+
+            lock.lock();
+            for (const Slice& s : slices) {
+                s.request->remaining -= s.count;
+                s.request->failed |= !ok;
+            }
+            ++batches_;
+            images_ += n;
+            lock.unlock();
+            done_.notify_all();
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        arrived_.notify_all();
+    }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fprintf(stderr, "Served %ld requests, %ld images in %ld batches (%.1f images per batch)\n",
+                requests_, images_, batches_, batches_ ? (double)images_ / batches_ : 0.0);
+    }
+
+private:
+    struct Request {
+        const float* images;
+        int count;
+        float* probs;
+        int taken;          // images handed to a batch
+        int remaining;      // images without probabilities yet
+        std::chrono::steady_clock::time_point arrival;
+        bool failed;
+    };
+    // Images [offset, offset + count) of a request at row `at` of the batch
+    struct Slice {
+        Request* request;
+        int offset, at, count;
+    };
+
+    Network& net_;
+    int max_batch_;
+    std::chrono::microseconds max_wait_;
+    std::mutex mutex_;
+    std::condition_variable arrived_, done_;
+    std::deque<Request*> queue_;
+    long queued_ = 0;           // images queued but not yet in a batch
+    bool stopping_ = false;
+    long requests_ = 0, images_ = 0, batches_ = 0;
+};
+
+// Answers the requests of one client until it disconnects or errs
+static void serve_connection(int fd, Batcher& batcher) {
+    std::vector<float> images, probs;
+    InferenceHeader request;
+    while (read_full(fd, &request, sizeof(request))) {
+        InferenceHeader reply = {inference_reply_magic, INFERENCE_OK, request.count, 0};
+        if (request.magic != inference_request_magic || request.count == 0 || request.count > max_request_images) {
+            // The stream cannot be resynchronized after a bad header
+            reply.status = INFERENCE_BAD_REQUEST;
+            reply.count = 0;
+            write_full(fd, &reply, sizeof(reply));
+            break;
+        }
+        images.resize((size_t)request.count * input_size);
+        probs.resize((size_t)request.count * num_classes);
+        if (!read_full(fd, images.data(), images.size() * sizeof(float)))
+            break;
+        if (!batcher.submit(images.data(), request.count, probs.data())) {
+            reply.status = INFERENCE_FAILED;
+            reply.count = 0;
+            if (!write_full(fd, &reply, sizeof(reply)))
+                break;
+            continue;
+        }
+        if (!write_full(fd, &reply, sizeof(reply)) || !write_full(fd, probs.data(), probs.size() * sizeof(float)))
+            break;
+    }
+}
+
+struct Connection {
+    int fd;
+    std::thread thread;
+    std::atomic<bool> finished{false};
+};
+
+// Listening socket at `path`. A socket file left by a server that is no
+// longer running is replaced; one that still answers is an error.
+static int listen_at(const std::string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path too long: " + path);
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool running = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    if (probe >= 0) close(probe);
+    if (running) throw std::runtime_error("A server is already listening on " + path);
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) throw std::runtime_error(path + " exists and is not a socket");
+        unlink(path.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        std::string error = strerror(errno);
+        close(fd);
+        throw std::runtime_error("Could not listen on " + path + ": " + error);
+    }
+    return fd;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [--socket PATH] [--model FILE] [--verify] [--max-batch N] [--max-wait-us N]\n"
+                    "Serves predictions on a Unix socket until SIGINT or SIGTERM\n"
+                    "(test_model --server PATH is a client). --verify checks the model\n"
+                    "data against its checksum before serving.\n", name);
+}
+
+int main(int argc, char** argv) {
+    std::string socket_path = "/tmp/mnist.sock";
+    std::string model_path = "mnist_model.bin";
+    int max_batch = 64;
+    long max_wait_us = 200;
+    bool verify = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--socket" && has_value) {
+            socket_path = argv[++i];
+        } else if (arg == "--model" && has_value) {
+            model_path = argv[++i];
+        } else if (arg == "--verify") {
+            verify = true;
+        } else if (arg == "--max-batch" && has_value) {
+            max_batch = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--max-wait-us" && has_value) {
+            max_wait_us = std::max(0L, atol(argv[++i]));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    print_backend(active_backend());
+    std::unique_ptr<Network> net;
+    int listen_fd;
+    try {
+        net.reset(new Network(model_path, max_batch, verify));
+        listen_fd = listen_at(socket_path);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+    struct sigaction sa = {};
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    fprintf(stderr, "Serving %s on %s, batches of up to %d images, waiting up to %ld us\n",
+            model_path.c_str(), socket_path.c_str(), max_batch, max_wait_us);
+
+    Batcher batcher(*net, max_batch, std::chrono::microseconds(max_wait_us));
+    std::thread batch_thread([&] { batcher.run(); });
+    std::list<Connection> connections;
+    while (!stop_requested) {
+        // Wake up now and then to notice the stop flag and reap finished connections
+        pollfd p = {listen_fd, POLLIN, 0};
+        int ready = poll(&p, 1, 250);
+        for (auto it = connections.begin(); it != connections.end();) {
+            if (it->finished) {
+                it->thread.join();
+                close(it->fd);
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (ready <= 0)
+            continue;
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        connections.emplace_back();
+        Connection& c = connections.back();
+        c.fd = fd;
+        c.thread = std::thread([&c, &batcher] {
+            serve_connection(c.fd, batcher);
+            c.finished = true;
+        });
+    }
+
+    // Stop taking connections, answer what is in flight, then end every
+    // connection still open
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    batcher.stop();
+    batch_thread.join();
+    for (Connection& c : connections) {
+        shutdown(c.fd, SHUT_RDWR);
+        c.thread.join();
+        close(c.fd);
+    }
+    batcher.print_stats();
+    return 0;
+}
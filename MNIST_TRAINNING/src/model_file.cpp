@@ -0,0 +1,217 @@
+#include <zlib.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "model_file.h"
+
+const char model_magic[8] = {'M', 'N', 'I', 'S', 'T', 'M', 'D', 'L'};
+const uint32_t model_version = 1;
+const size_t model_alignment = 64;
+const int max_dims = 4;
+
+enum ModelDtype : uint32_t { DTYPE_F32 = 1 };
+
+struct ModelHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_crc;        // crc32 of this header with header_crc = 0
+    char architecture[32];      // NUL-terminated
+    uint32_t tensor_count;
+    uint32_t alignment;
+    uint64_t table_offset;      // tensor_count TensorEntry
+    uint64_t file_size;
+    uint32_t table_crc;
+    uint32_t data_crc;          // crc32 of every byte after the table
+};
+
+struct TensorEntry {
+    char name[48];              // NUL-terminated
+    uint32_t dtype;
+    uint32_t dims;
+    uint32_t shape[max_dims];
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+size_t ModelTensor::size() const {
+    size_t n = 1;
+    for (int d : shape)
+        n *= d;
+    return n;
+}
+
+static size_t align_up(size_t n) {
+    return (n + model_alignment - 1) / model_alignment * model_alignment;
+}
+
+static uint32_t crc(const void* data, size_t size) {
+    return crc32_z(0, static_cast<const Bytef*>(data), size);
+}
+
+static uint32_t header_crc(ModelHeader header) {
+    header.header_crc = 0;
+    return crc(&header, sizeof(header));
+}
+
+static std::string shape_string(const std::vector<int>& shape) {
+    std::string s;
+    for (size_t i = 0; i < shape.size(); ++i)
+        s += (i ? "x" : "") + std::to_string(shape[i]);
+    return s;
+}
+
+void save_model(const std::string& path, const std::string& architecture,
+                const std::vector<ModelTensor>& tensors) {
+    if (architecture.size() >= sizeof(ModelHeader::architecture))
+        throw std::runtime_error("Architecture name too long: " + architecture);
+
+    ModelHeader h = {};
+    memcpy(h.magic, model_magic, sizeof(model_magic));
+    h.version = model_version;
+    memcpy(h.architecture, architecture.data(), architecture.size());
+    h.tensor_count = tensors.size();
+    h.alignment = model_alignment;
+    h.table_offset = sizeof(h);
+
+    std::vector<TensorEntry> table(tensors.size());
+    size_t offset = align_up(h.table_offset + table.size() * sizeof(TensorEntry));
+    size_t data_start = offset;
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const ModelTensor& t = tensors[i];
+        TensorEntry& e = table[i];
+        if (t.name.size() >= sizeof(e.name) || t.shape.empty() || t.shape.size() > max_dims)
+            throw std::runtime_error("Cannot store tensor " + t.name + " " + shape_string(t.shape));
+        memcpy(e.name, t.name.data(), t.name.size());
+        e.dtype = DTYPE_F32;
+        e.dims = t.shape.size();
+        for (size_t d = 0; d < t.shape.size(); ++d)
+            e.shape[d] = t.shape[d];
+        e.offset = offset;
+        e.bytes = t.size() * sizeof(float);
+        offset = align_up(offset + e.bytes);
+    }
+    h.file_size = offset;
+    h.table_crc = crc(table.data(), table.size() * sizeof(TensorEntry));
+
+    // Data region as it will be on disk, padding included, for its checksum
+    std::vector<unsigned char> data(h.file_size - data_start, 0);
+    for (size_t i = 0; i < tensors.size(); ++i)
+        memcpy(&data[table[i].offset - data_start], tensors[i].data, table[i].bytes);
+    h.data_crc = crc(data.data(), data.size());
+    h.header_crc = header_crc(h);
+
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) throw std::runtime_error("Could not create file: " + tmp);
+    std::vector<char> padding(model_alignment, 0);
+    size_t table_end = h.table_offset + table.size() * sizeof(TensorEntry);
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1
+        && fwrite(table.data(), sizeof(TensorEntry), table.size(), fp) == table.size()
+        && fwrite(padding.data(), 1, data_start - table_end, fp) == data_start - table_end
+        && fwrite(data.data(), 1, data.size(), fp) == data.size();
+    ok = fclose(fp) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("Could not write file: " + path);
+    }
+}
+
+ModelFile::ModelFile(const std::string& path, const std::vector<ModelTensor>& legacy) : path_(path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Could not open file: " + path);
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) throw std::runtime_error("Could not map file: " + path);
+    mapping_ = map;
+    mapping_size_ = st.st_size;
+    const char* base = static_cast<const char*>(map);
+    size_t size = mapping_size_;
+
+    if (size < sizeof(ModelHeader) || memcmp(base, model_magic, sizeof(model_magic)) != 0) {
+        size_t expected = 0;
+        for (const ModelTensor& t : legacy)
+            expected += t.size() * sizeof(float);
+        if (legacy.empty() || size != expected) {
+            munmap(mapping_, mapping_size_);
+            throw std::runtime_error("Not a model file: " + path);
+        }
+        size_t offset = 0;
+        for (const ModelTensor& t : legacy) {
+            tensors_.push_back({t.name, t.shape, reinterpret_cast<const float*>(base + offset)});
+            offset += t.size() * sizeof(float);
+        }
+        architecture_ = "legacy";
+        return;
+    }
+
+    ModelHeader h;
+    memcpy(&h, base, sizeof(h));
+    auto fail = [&](const char* what) {
+        munmap(mapping_, mapping_size_);
+        throw std::runtime_error(std::string(what) + ": " + path);
+    };
+    if (h.version != model_version) fail("Unsupported model file version");
+    if (h.header_crc != header_crc(h) || h.file_size != size || h.alignment != model_alignment
+        || h.table_offset + (uint64_t)h.tensor_count * sizeof(TensorEntry) > size
+        || memchr(h.architecture, 0, sizeof(h.architecture)) == nullptr)
+        fail("Corrupt model file header");
+
+    const char* table_base = base + h.table_offset;
+    size_t table_bytes = (size_t)h.tensor_count * sizeof(TensorEntry);
+    if (h.table_crc != crc(table_base, table_bytes)) fail("Corrupt model file table");
+    size_t data_start = align_up(h.table_offset + table_bytes);
+    if (data_start > size) fail("Corrupt model file table");
+
+    for (uint32_t i = 0; i < h.tensor_count; ++i) {
+        TensorEntry e;
+        memcpy(&e, table_base + i * sizeof(TensorEntry), sizeof(e));
+        if (e.dtype != DTYPE_F32 || e.dims == 0 || e.dims > max_dims || memchr(e.name, 0, sizeof(e.name)) == nullptr)
+            fail("Unsupported tensor in model file");
+        ModelTensor t;
+        t.name = e.name;
+        t.shape.assign(e.shape, e.shape + e.dims);
+        if (e.offset % model_alignment != 0 || e.bytes != t.size() * sizeof(float) || e.offset < data_start
+            || e.offset + e.bytes > size)
+            fail("Corrupt model file table");
+        t.data = reinterpret_cast<const float*>(base + e.offset);
+        tensors_.push_back(t);
+    }
+    architecture_ = h.architecture;
+    version_ = h.version;
+    data_start_ = data_start;
+    data_crc_ = h.data_crc;
+}
+
+ModelFile::~ModelFile() {
+    munmap(mapping_, mapping_size_);
+}
+
+void ModelFile::verify() const {
+    if (version_ == 0)
+        return;
+    const char* base = static_cast<const char*>(mapping_);
+    if (crc(base + data_start_, mapping_size_ - data_start_) != data_crc_)
+        throw std::runtime_error("Corrupt model file data: " + path_);
+}
+
+const float* ModelFile::tensor(const std::string& name, const std::vector<int>& shape) const {
+    for (const ModelTensor& t : tensors_) {
+        if (t.name != name)
+            continue;
+        if (t.shape != shape) {
+            throw std::runtime_error("Tensor " + name + " in " + path_ + " is " + shape_string(t.shape)
+                                     + ", expected " + shape_string(shape));
+        }
+        return t.data;
+    }
+    throw std::runtime_error("No tensor " + name + " in " + path_);
+}
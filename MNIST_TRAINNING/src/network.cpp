@@ -0,0 +1,77 @@
+#include <stdexcept>
+#include <vector>
+#include "backend.h"
+#include "kernels.h"
+#include "memory.h"
+#include "model_file.h"
+#include "network.h"
+
+const int input_size = Network::input_size;
+const int hidden_size = Network::hidden_size;
+const int num_classes = Network::num_classes;
+
+// Tensors of the model, in the order the raw dumps from before the model
+// file format stored them
+static const std::vector<ModelTensor> model_tensors = {
+    {"fc1.weight", {hidden_size, input_size}},
+    {"fc1.bias", {hidden_size}},
+    {"fc2.weight", {num_classes, hidden_size}},
+    {"fc2.bias", {num_classes}},
+};
+
+Network::Network(const std::string& model_path, int max_batch, bool verify) : max_batch_(max_batch) {
+    if (max_batch < 1) throw std::runtime_error("Network batch size must be positive");
+    model_.reset(new ModelFile(model_path, model_tensors));
+    if (model_->architecture() != "fc-relu-fc" && model_->architecture() != "legacy") {
+        throw std::runtime_error("Model architecture is " + model_->architecture() + ", expected fc-relu-fc");
+    }
+    if (verify)
+        model_->verify();
+    // Pointers into the mapping; the kernels only read the parameters
+    float* h_fc1_weights = const_cast<float*>(model_->tensor("fc1.weight", {hidden_size, input_size}));
+    float* h_fc1_bias = const_cast<float*>(model_->tensor("fc1.bias", {hidden_size}));
+    float* h_fc2_weights = const_cast<float*>(model_->tensor("fc2.weight", {num_classes, hidden_size}));
+    float* h_fc2_bias = const_cast<float*>(model_->tensor("fc2.bias", {num_classes}));
+
+    input_ = static_cast<float*>(cuda_malloc(max_batch * input_size * sizeof(float)));
+    hidden_ = static_cast<float*>(cuda_malloc(max_batch * hidden_size * sizeof(float)));
+    output_ = static_cast<float*>(cuda_malloc(max_batch * num_classes * sizeof(float)));
+    device_params_ = active_backend()->caps.device_memory;
+    if (!device_params_) {
+        fc1_weights_ = h_fc1_weights;
+        fc1_bias_ = h_fc1_bias;
+        fc2_weights_ = h_fc2_weights;
+        fc2_bias_ = h_fc2_bias;
+        return;
+    }
+    fc1_weights_ = static_cast<float*>(cuda_malloc(input_size * hidden_size * sizeof(float)));
+    fc1_bias_ = static_cast<float*>(cuda_malloc(hidden_size * sizeof(float)));
+    fc2_weights_ = static_cast<float*>(cuda_malloc(hidden_size * num_classes * sizeof(float)));
+    fc2_bias_ = static_cast<float*>(cuda_malloc(num_classes * sizeof(float)));
+    copy_to_device(fc1_weights_, h_fc1_weights, input_size * hidden_size * sizeof(float));
+    copy_to_device(fc1_bias_, h_fc1_bias, hidden_size * sizeof(float));
+    copy_to_device(fc2_weights_, h_fc2_weights, hidden_size * num_classes * sizeof(float));
+    copy_to_device(fc2_bias_, h_fc2_bias, num_classes * sizeof(float));
+}
+
+Network::~Network() {
+    cuda_free(input_);
+    cuda_free(hidden_);
+    cuda_free(output_);
+    if (device_params_) {
+        cuda_free(fc1_weights_);
+        cuda_free(fc1_bias_);
+        cuda_free(fc2_weights_);
+        cuda_free(fc2_bias_);
+    }
+}
+
+void Network::predict(const float* images, int count, float* probs) {
+    if (count < 1 || count > max_batch_) throw std::runtime_error("Network batch size out of range");
+    copy_to_device(input_, (void*)images, count * input_size * sizeof(float));
+    fc_forward(input_, fc1_weights_, fc1_bias_, hidden_, count, input_size, hidden_size);
+    relu_activation(hidden_, hidden_, count * hidden_size);
+    fc_forward(hidden_, fc2_weights_, fc2_bias_, output_, count, hidden_size, num_classes);
+    softmax(output_, output_, count, num_classes);
+    copy_to_host(probs, output_, count * num_classes * sizeof(float));
+}
@@ -0,0 +1,160 @@
+// Checks GzIndex and the ranged IDX loaders against full loads: random
+// reads through a freshly built index, the same through the index read back
+// from disk and through one rebuilt after corruption, shards of a dataset,
+// and out-of-range requests. Exits 1 if any check fails.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <zlib.h>
+#include "data_loader.h"
+#include "gz_index.h"
+
+static int failures = 0;
+
+static void expect(bool ok, const std::string& what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what.c_str());
+        ++failures;
+    }
+}
+
+// The whole uncompressed file, straight through zlib
+static std::vector<unsigned char> gunzip(const std::string& path) {
+    gzFile f = gzopen(path.c_str(), "rb");
+    if (!f) throw std::runtime_error("Could not open file: " + path);
+    std::vector<unsigned char> data;
+    unsigned char chunk[1 << 16];
+    int n;
+    while ((n = gzread(f, chunk, sizeof(chunk))) > 0)
+        data.insert(data.end(), chunk, chunk + n);
+    gzclose(f);
+    if (n < 0) throw std::runtime_error("Corrupt gzip data: " + path);
+    return data;
+}
+
+static void copy_file(const std::string& from, const std::string& to) {
+    std::vector<unsigned char> data;
+    FILE* in = fopen(from.c_str(), "rb");
+    if (!in) throw std::runtime_error("Could not open file: " + from);
+    unsigned char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+        data.insert(data.end(), chunk, chunk + n);
+    fclose(in);
+    FILE* out = fopen(to.c_str(), "wb");
+    if (!out || fwrite(data.data(), 1, data.size(), out) != data.size())
+        throw std::runtime_error("Could not write " + to);
+    fclose(out);
+}
+
+// `reads` random ranges, a few at the very start and end, through `index`
+static void check_reads(const GzIndex& index, const std::vector<unsigned char>& full, int reads,
+                        const std::string& what) {
+    expect(index.uncompressed_size() == full.size(), what + ": uncompressed size");
+    std::mt19937 rng(1);
+    std::vector<unsigned char> got;
+    for (int i = 0; i < reads; ++i) {
+        size_t size = rng() % (3 * 32768) + 1;
+        size_t offset = rng() % (full.size() - size + 1);
+        if (i == 0) offset = 0;
+        if (i == 1) offset = full.size() - size;
+        got.resize(size);
+        index.read(offset, got.data(), size);
+        if (memcmp(got.data(), full.data() + offset, size) != 0) {
+            expect(false, what + ": " + std::to_string(size) + " bytes at " + std::to_string(offset));
+            return;
+        }
+    }
+    bool threw = false;
+    try {
+        index.read(full.size() - 1, got.data(), 2);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    expect(threw, what + ": read past the end did not throw");
+}
+
+int main(int argc, char** argv) {
+    std::string images_path = argc > 1 ? argv[1] : "data/t10k-images-idx3-ubyte.gz";
+    std::string labels_path = argc > 2 ? argv[2] : "data/t10k-labels-idx1-ubyte.gz";
+    const size_t span = 1 << 16;
+    try {
+        std::vector<unsigned char> full = gunzip(images_path);
+
+        // A private copy, so the small-span index does not replace the one
+        // beside the dataset
+        char dir[] = "/tmp/test_gz_index.XXXXXX";
+        if (!mkdtemp(dir)) throw std::runtime_error("mkdtemp failed");
+        std::string copy = std::string(dir) + "/images.gz", index_path = copy + ".gzidx";
+        copy_file(images_path, copy);
+        {
+            GzIndex built(copy, span);
+            printf("%zu access points over %zu bytes\n", built.points(), built.uncompressed_size());
+            expect(built.points() > 1, "index has a single access point");
+            check_reads(built, full, 300, "built index");
+        }
+        check_reads(GzIndex(copy, span), full, 300, "index read back");
+        // A flipped byte in the saved index fails its crc and it is rebuilt
+        FILE* f = fopen(index_path.c_str(), "r+b");
+        if (f) {
+            fseek(f, -100, SEEK_END);
+            int c = fgetc(f);
+            fseek(f, -100, SEEK_END);
+            fputc(c ^ 0xff, f);
+            fclose(f);
+        }
+        check_reads(GzIndex(copy, span), full, 100, "index rebuilt after corruption");
+        // Uncompressed files are read in place
+        std::string raw = std::string(dir) + "/images";
+        FILE* out = fopen(raw.c_str(), "wb");
+        if (!out || fwrite(full.data(), 1, full.size(), out) != full.size())
+            throw std::runtime_error("Could not write " + raw);
+        fclose(out);
+        check_reads(GzIndex(raw, span), full, 100, "uncompressed file");
+        unlink(raw.c_str());
+        unlink(copy.c_str());
+        unlink(index_path.c_str());
+        rmdir(dir);
+
+        // Shards through the ranged loaders against the full loads
+        int num_images, rows, cols, num_labels;
+        std::vector<unsigned char> pixels = load_mnist_pixels(images_path, num_images, rows, cols);
+        std::vector<int> labels = load_mnist_labels(labels_path, num_labels);
+        const int shards = 4;
+        size_t image_size = (size_t)rows * cols;
+        for (int s = 0; s < shards; ++s) {
+            int first = (int)((long)num_images * s / shards);
+            int count = (int)((long)num_images * (s + 1) / shards) - first;
+            int n, r, c, nl;
+            std::vector<unsigned char> p = load_mnist_pixels(images_path, first, count, n, r, c);
+            std::vector<int> l = load_mnist_labels(labels_path, first, count, nl);
+            expect(n == num_images && r == rows && c == cols && nl == num_labels, "shard header counts");
+            expect(p.size() == count * image_size
+                   && memcmp(p.data(), pixels.data() + first * image_size, p.size()) == 0,
+                   "image shard " + std::to_string(s));
+            expect(std::equal(l.begin(), l.end(), labels.begin() + first), "label shard " + std::to_string(s));
+        }
+        bool threw = false;
+        try {
+            load_mnist_pixels(images_path, num_images - 1, 2, num_images, rows, cols);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        expect(threw, "out-of-range shard did not throw");
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+    if (failures) {
+        fprintf(stderr, "%d gz index check%s failed\n", failures, failures == 1 ? "" : "s");
+        return 1;
+    }
+    printf("gz index checks passed\n");
+    return 0;
+}
@@ -1,134 +1,384 @@
-#include <iostream>
-#include <vector>
-#include <cstdio>
-#include "kernels.h"
-#include "memory.h"
-#include "utils.h"
-
-// Network parameters (must match training)
-const int input_size = 28 * 28;
-const int hidden_size = 128;
-const int num_classes = 10;
-
-// Load model parameters
-void load_model(std::vector<float>& fc1_weights, std::vector<float>& fc1_bias,
-               std::vector<float>& fc2_weights, std::vector<float>& fc2_bias) {
-    FILE* fp = fopen("mnist_model.bin", "rb");
-    if (!fp) {
-        std::cerr << "Error: Could not open model file" << std::endl;
-        exit(1);
-    }
-    
-    fread(fc1_weights.data(), sizeof(float), fc1_weights.size(), fp);
-    fread(fc1_bias.data(), sizeof(float), fc1_bias.size(), fp);
-    fread(fc2_weights.data(), sizeof(float), fc2_weights.size(), fp);
-    fread(fc2_bias.data(), sizeof(float), fc2_bias.size(), fp);
-    fclose(fp);
-}
-
-// Load and preprocess a custom image
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
-std::vector<float> load_image(const char* filename) {
-    int width, height, channels;
-    unsigned char* img = stbi_load(filename, &width, &height, &channels, 0);
-    if (!img) {
-        std::cerr << "Error: Could not load image " << filename << std::endl;
-        exit(1);
-    }
-    
-    std::vector<float> processed(28 * 28, 0.0f);
-    
-    // Simple resizing and conversion to grayscale
-    for (int y = 0; y < 28; y++) {
-        for (int x = 0; x < 28; x++) {
-            int src_x = x * width / 28;
-            int src_y = y * height / 28;
-            
-            float pixel = 0.0f;
-            if (channels == 1) {
-                pixel = img[src_y * width + src_x] / 255.0f;
-            } else {
-                // Convert RGB to grayscale
-                unsigned char* p = img + (src_y * width + src_x) * channels;
-                pixel = (0.3f * p[0] + 0.59f * p[1] + 0.11f * p[2]) / 255.0f;
-            }
-            
-            // MNIST has white digits on black background (1.0 = white)
-            // If your image has black digits on white, invert:
-            pixel = 1.0f - pixel;
-            
-            processed[y * 28 + x] = pixel;
-        }
-    }
-    
-    stbi_image_free(img);
-    return processed;
-}
-
-int main(int argc, char** argv) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <image_path>" << std::endl;
-        return 1;
-    }
-    
-    const char* image_path = argv[1];
-    
-    // Load the image
-    std::vector<float> image = load_image(image_path);
-    
-    // Load the model
-    std::vector<float> h_fc1_weights(input_size * hidden_size);
-    std::vector<float> h_fc1_bias(hidden_size);
-    std::vector<float> h_fc2_weights(hidden_size * num_classes);
-    std::vector<float> h_fc2_bias(num_classes);
-    load_model(h_fc1_weights, h_fc1_bias, h_fc2_weights, h_fc2_bias);
-    
-    // Allocate device memory
-    float* d_input = static_cast<float*>(cuda_malloc(input_size * sizeof(float)));
-    float* d_hidden = static_cast<float*>(cuda_malloc(hidden_size * sizeof(float)));
-    float* d_output = static_cast<float*>(cuda_malloc(num_classes * sizeof(float)));
-    float* d_fc1_weights = static_cast<float*>(cuda_malloc(input_size * hidden_size * sizeof(float)));
-    float* d_fc1_bias = static_cast<float*>(cuda_malloc(hidden_size * sizeof(float)));
-    float* d_fc2_weights = static_cast<float*>(cuda_malloc(hidden_size * num_classes * sizeof(float)));
-    float* d_fc2_bias = static_cast<float*>(cuda_malloc(num_classes * sizeof(float)));
-    
-    // Copy data to device
-    copy_to_device(d_input, image.data(), input_size * sizeof(float));
-    copy_to_device(d_fc1_weights, h_fc1_weights.data(), h_fc1_weights.size() * sizeof(float));
-    copy_to_device(d_fc1_bias, h_fc1_bias.data(), h_fc1_bias.size() * sizeof(float));
-    copy_to_device(d_fc2_weights, h_fc2_weights.data(), h_fc2_weights.size() * sizeof(float));
-    copy_to_device(d_fc2_bias, h_fc2_bias.data(), h_fc2_bias.size() * sizeof(float));
-    
-    // Forward pass
-    fc_forward(d_input, d_fc1_weights, d_fc1_bias, d_hidden, input_size, hidden_size);
-    relu_activation(d_hidden, d_hidden, hidden_size);
-    fc_forward(d_hidden, d_fc2_weights, d_fc2_bias, d_output, hidden_size, num_classes);
-    softmax(d_output, d_output, num_classes);
-    
-    // Get results
-    std::vector<float> output(num_classes);
-    copy_to_host(output.data(), d_output, num_classes * sizeof(float));
-    
-    // Find prediction
-    int prediction = argmax(output.data(), num_classes);
-    
-    // Print results
-    std::cout << "Predicted digit: " << prediction << std::endl;
-    std::cout << "Confidence scores:" << std::endl;
-    for (int i = 0; i < num_classes; ++i) {
-        std::cout << "  " << i << ": " << (output[i] * 100.0f) << "%" << std::endl;
-    }
-    
-    // Cleanup
-    cuda_free(d_input);
-    cuda_free(d_hidden);
-    cuda_free(d_output);
-    cuda_free(d_fc1_weights);
-    cuda_free(d_fc1_bias);
-    cuda_free(d_fc2_weights);
-    cuda_free(d_fc2_bias);
-    
-    return 0;
-}
\ No newline at end of file
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "backend.h"
+#include "data_loader.h"
+#include "image_loader.h"
+#include "inference_client.h"
+#include "network.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+const int input_size = Network::input_size;
+const int num_classes = Network::num_classes;
+
+// An IDX image file, decoded once, and its labels when the matching
+// labels file sits beside it
+struct IdxSet {
+    explicit IdxSet(const std::string& path) : path(path) {}
+
+    std::string path;
+    std::vector<unsigned char> pixels;
+    std::vector<int> labels;
+};
+
+// One image to score: a record of an IDX set, or an image file
+struct Sample {
+    std::string name;           // file path, or <idx path>:<index>
+    int label;                  // -1 when unknown
+    const IdxSet* idx;
+    int index;
+};
+
+static bool is_idx_images(const std::string& path) {
+    return path.find("idx3-ubyte") != std::string::npos;
+}
+
+static bool is_image_file(const fs::path& path) {
+    static const char* extensions[] = {".png", ".jpg", ".jpeg", ".bmp", ".gif", ".tga", ".pgm", ".ppm", ".pnm", ".psd"};
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    for (const char* e : extensions)
+        if (ext == e) return true;
+    return false;
+}
+
+// Images filed under a directory named after their digit are labelled
+static int label_from_path(const fs::path& path) {
+    std::string dir = path.parent_path().filename().string();
+    return dir.size() == 1 && dir[0] >= '0' && dir[0] <= '9' ? dir[0] - '0' : -1;
+}
+
+static void add_idx(const std::string& path, std::vector<std::unique_ptr<IdxSet>>& sets, std::vector<Sample>& samples) {
+    std::unique_ptr<IdxSet> set(new IdxSet(path));
+    int num_images, rows, cols;
+    set->pixels = load_mnist_pixels(path, num_images, rows, cols);
+    if (rows * cols != input_size) {
+        throw std::runtime_error(path + " holds " + std::to_string(rows) + "x" + std::to_string(cols) + " images, expected 28x28");
+    }
+    std::string labels_path = path;
+    size_t at = labels_path.find("images-idx3");
+    if (at != std::string::npos) {
+        labels_path.replace(at, strlen("images-idx3"), "labels-idx1");
+        int num_labels;
+        if (fs::exists(labels_path)) {
+            set->labels = load_mnist_labels(labels_path, num_labels);
+            if (num_labels != num_images) {
+                throw std::runtime_error("Image and label counts differ: " + path + ", " + labels_path);
+            }
+        }
+    }
+    for (int i = 0; i < num_images; ++i)
+        samples.push_back({path + ":" + std::to_string(i), set->labels.empty() ? -1 : set->labels[i], set.get(), i});
+    sets.push_back(std::move(set));
+}
+
+static void add_path(const std::string& path, std::vector<std::unique_ptr<IdxSet>>& sets, std::vector<Sample>& samples) {
+    if (fs::is_directory(path)) {
+        // Sorted so the output order does not depend on the file system
+        std::vector<fs::path> files;
+        for (const auto& entry : fs::recursive_directory_iterator(path))
+            if (entry.is_regular_file() && is_image_file(entry.path()))
+                files.push_back(entry.path());
+        std::sort(files.begin(), files.end());
+        for (const fs::path& file : files)
+            samples.push_back({file.string(), label_from_path(file), nullptr, 0});
+    } else if (is_idx_images(path)) {
+        add_idx(path, sets, samples);
+    } else {
+        samples.push_back({path, label_from_path(path), nullptr, 0});
+    }
+}
+
+// Decodes samples [first, first + count) into images, count x input_size,
+// on `threads` threads; a sample that fails gets its message in errors
+static void decode_batch(const std::vector<Sample>& samples, int first, int count, float* images,
+                         std::string* errors, int threads) {
+    std::atomic<int> next(0);
+    auto work = [&] {
+        for (int i; (i = next++) < count;) {
+            const Sample& s = samples[first + i];
+            float* dst = images + (size_t)i * input_size;
+            errors[i].clear();
+            if (s.idx) {
+                const unsigned char* src = s.idx->pixels.data() + (size_t)s.index * input_size;
+                for (int p = 0; p < input_size; ++p)
+                    dst[p] = src[p] / 255.0f;
+                continue;
+            }
+            try {
+                std::vector<float> image = load_image(s.name);
+                std::copy(image.begin(), image.end(), dst);
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+                std::fill(dst, dst + input_size, 0.0f);
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < std::min(threads, count); ++t)
+        pool.emplace_back(work);
+    work();
+    for (std::thread& t : pool)
+        t.join();
+}
+
+static std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static std::string csv_field(const std::string& s) {
+    if (s.find_first_of(",\"\n") == std::string::npos)
+        return s;
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// One row per image as it is scored, then the totals
+class ResultWriter {
+public:
+    explicit ResultWriter(bool json) : json_(json) {
+        if (json_)
+            printf("{\"results\": [");
+        else
+            printf("path,label,prediction,confidence\n");
+    }
+
+    void row(const Sample& s, int prediction, float confidence) {
+        if (json_) {
+            printf("%s\n  {\"path\": %s, \"label\": ", rows_ ? "," : "", json_string(s.name).c_str());
+            if (s.label >= 0) printf("%d", s.label);
+            else printf("null");
+            printf(", \"prediction\": %d, \"confidence\": %.6f}", prediction, confidence);
+        } else {
+            printf("%s,", csv_field(s.name).c_str());
+            if (s.label >= 0) printf("%d", s.label);
+            printf(",%d,%.6f\n", prediction, confidence);
+        }
+        ++rows_;
+    }
+
+    void finish(int images, int failed, int labelled, int correct, double seconds) {
+        double accuracy = labelled ? 100.0 * correct / labelled : 0.0;
+        if (json_) {
+            printf("\n], \"summary\": {\"images\": %d, \"failed\": %d, \"labelled\": %d, \"correct\": %d, ",
+                   images, failed, labelled, correct);
+            if (labelled) printf("\"accuracy\": %.4f, ", accuracy);
+            else printf("\"accuracy\": null, ");
+            printf("\"seconds\": %.4f, \"images_per_second\": %.1f}}\n", seconds, images / seconds);
+        }
+        fflush(stdout);
+        fprintf(stderr, "Scored %d images (%d failed) in %.3f s, %.0f images/s", images, failed, seconds,
+                images / seconds);
+        if (labelled) fprintf(stderr, ", accuracy %.2f%% (%d / %d labelled)", accuracy, correct, labelled);
+        fprintf(stderr, "\n");
+    }
+
+private:
+    bool json_;
+    long rows_ = 0;
+};
+
+// Class probabilities of a batch, from the network here or from a server
+typedef std::function<void(const float* images, int count, float* probs)> Predictor;
+
+// Scores every sample, decoding the next batch while the current one runs
+static int run_batch(const std::vector<Sample>& samples, const Predictor& predict, int batch_size, int threads,
+                     bool json) {
+    ResultWriter writer(json);
+    auto start = std::chrono::steady_clock::now();
+    int total = samples.size();
+    std::vector<float> images[2] = {std::vector<float>((size_t)batch_size * input_size),
+                                    std::vector<float>((size_t)batch_size * input_size)};
+    std::vector<std::string> errors[2] = {std::vector<std::string>(batch_size), std::vector<std::string>(batch_size)};
+    std::vector<float> probs((size_t)batch_size * num_classes);
+    int failed = 0, labelled = 0, correct = 0;
+
+    if (total > 0)
+        decode_batch(samples, 0, std::min(batch_size, total), images[0].data(), errors[0].data(), threads);
+    for (int first = 0, cur = 0; first < total; first += batch_size, cur ^= 1) {
+        int count = std::min(batch_size, total - first);
+        int next_first = first + batch_size;
+        std::future<void> decoding;
+        if (next_first < total) {
+            decoding = std::async(std::launch::async, decode_batch, std::cref(samples), next_first,
+                                  std::min(batch_size, total - next_first), images[cur ^ 1].data(),
+                                  errors[cur ^ 1].data(), threads);
+        }
+        try {
+            predict(images[cur].data(), count, probs.data());
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            if (decoding.valid())
+                decoding.get();
+            return 1;
+        }
+        for (int i = 0; i < count; ++i) {
+            const Sample& s = samples[first + i];
+            if (!errors[cur][i].empty()) {
+                fprintf(stderr, "Error: %s\n", errors[cur][i].c_str());
+                ++failed;
+                continue;
+            }
+            const float* p = probs.data() + (size_t)i * num_classes;
+            int prediction = argmax(p, num_classes);
+            writer.row(s, prediction, p[prediction]);
+            if (s.label >= 0) {
+                ++labelled;
+                correct += prediction == s.label;
+            }
+        }
+        if (decoding.valid())
+            decoding.get();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    writer.finish(total - failed, failed, labelled, correct, seconds > 0 ? seconds : 1e-9);
+    return failed ? 2 : 0;
+}
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " <image_path>\n"
+              << "       " << name << " [--format csv|json] [--batch N] [--threads N] [--list FILE]\n"
+              << "           [--server SOCKET] <path>...\n"
+              << "Scores images, directories of images (searched recursively, labelled by a\n"
+              << "parent directory named after the digit) and IDX image files such as\n"
+              << "t10k-images-idx3-ubyte.gz (labelled by the labels file beside them).\n"
+              << "--list reads more paths from FILE, one per line, - for stdin. Results go\n"
+              << "to stdout as CSV or JSON, accuracy and throughput to stderr. --server sends\n"
+              << "the batches to a running mnist_server instead of loading the model." << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bool json = false;
+    int batch_size = 256;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string server;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--format" && has_value) {
+            std::string format = argv[++i];
+            if (format != "csv" && format != "json") {
+                usage(argv[0]);
+                return 1;
+            }
+            json = format == "json";
+        } else if (arg == "--batch" && has_value) {
+            batch_size = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--threads" && has_value) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--server" && has_value) {
+            server = argv[++i];
+        } else if (arg == "--list" && has_value) {
+            std::string list = argv[++i];
+            std::ifstream file;
+            if (list != "-") {
+                file.open(list);
+                if (!file) {
+                    std::cerr << "Error: Could not open list " << list << std::endl;
+                    return 1;
+                }
+            }
+            std::istream& in = list == "-" ? std::cin : file;
+            for (std::string line; std::getline(in, line);)
+                if (!line.empty()) paths.push_back(line);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    // A lone image file keeps the original one-image report
+    bool single = argc == 2 && !fs::is_directory(paths[0]) && !is_idx_images(paths[0]);
+
+    std::vector<std::unique_ptr<IdxSet>> sets;
+    std::vector<Sample> samples;
+    std::unique_ptr<Network> net;
+    std::unique_ptr<InferenceClient> client;
+    try {
+        for (const std::string& path : paths)
+            add_path(path, sets, samples);
+        if (!server.empty()) {
+            batch_size = std::min<int>(batch_size, max_request_images);
+            client.reset(new InferenceClient(server));
+        } else {
+            print_backend(active_backend());
+            net.reset(new Network("mnist_model.bin", single ? 1 : batch_size));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    if (client) {
+        return run_batch(samples, [&](const float* images, int count, float* probs) {
+            client->predict(images, count, probs);
+        }, batch_size, threads, json);
+    }
+    if (!single) {
+        return run_batch(samples, [&](const float* images, int count, float* probs) {
+            net->predict(images, count, probs);
+        }, batch_size, threads, json);
+    }
+
+    // Load the image
+    std::vector<float> image;
+    try {
+        image = load_image(paths[0]);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Forward pass
+    std::vector<float> output(num_classes);
+    net->predict(image.data(), 1, output.data());
+
+    // Find prediction
+    int prediction = argmax(output.data(), num_classes);
+
+    // Print results
+    std::cout << "Predicted digit: " << prediction << std::endl;
+    std::cout << "Confidence scores:" << std::endl;
+    for (int i = 0; i < num_classes; ++i) {
+        std::cout << "  " << i << ": " << (output[i] * 100.0f) << "%" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include "Allocator.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <new>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Same values as <numaif.h>, spelled out so we do not have to link libnuma.
+#define NN_MPOL_BIND		2
+#define NN_MPOL_INTERLEAVE	3
+#define NN_MPOL_MF_MOVE		(1 << 1)
+
+static size_t	roundUp(size_t v, size_t to) {
+	return (v + to - 1) / to * to;
+}
+
+static void	setNodePolicy(void *ptr, size_t len, int mode, unsigned long mask, unsigned flags) {
+#ifdef SYS_mbind
+	// maxnode counts one past the last valid bit, see mbind(2)
+	syscall(SYS_mbind, ptr, len, mode, &mask, sizeof(mask) * 8 + 1, flags);
+#else
+	(void)ptr; (void)len; (void)mode; (void)mask; (void)flags;
+#endif
+}
+
+int	Allocator::nodeCount() {
+	static int count = 0;
+
+	if (count == 0) {
+		int last = 0;
+		FILE *f = fopen("/sys/devices/system/node/online", "r");
+		if (f) {
+			// Format is a range list such as "0" or "0-1" or "0,2-3"
+			int a, b;
+			char sep;
+			while (fscanf(f, "%d", &a) == 1) {
+				b = a;
+				if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+					if (fscanf(f, "%d", &b) != 1)
+						break;
+					if (fscanf(f, "%c", &sep) != 1)
+						sep = '\n';
+				}
+				if (b > last)
+					last = b;
+				if (sep != ',')
+					break;
+			}
+			fclose(f);
+		}
+		count = last + 1;
+		if (count > (int)(sizeof(unsigned long) * 8))
+			count = sizeof(unsigned long) * 8;
+	}
+	return count;
+}
+
+int	Allocator::currentNode() {
+	// Workers are expected to be pinned, so the lookup is done once per thread.
+	static thread_local int node = -1;
+
+	if (node < 0) {
+		unsigned cpu = 0, n = 0;
+#ifdef SYS_getcpu
+		if (syscall(SYS_getcpu, &cpu, &n, NULL) != 0)
+			n = 0;
+#endif
+		node = (int)n < nodeCount() ? (int)n : 0;
+	}
+	return node;
+}
+
+void	*Allocator::allocate(size_t bytes, MemoryPolicy policy, int node, size_t &mapped) {
+	if (bytes == 0)
+		bytes = sizeof(double);
+
+	if (policy.placement == ALLOC_DEFAULT && policy.hugePages == HUGEPAGE_NONE) {
+		void *p = NULL;
+		if (posix_memalign(&p, ALIGNMENT, roundUp(bytes, ALIGNMENT)) != 0)
+			throw bad_alloc();
+		memset(p, 0, bytes);
+		mapped = 0;
+		return p;
+	}
+
+	// Huge pages only pay off once the buffer spans at least one of them,
+	// smaller matrices would waste most of a 2 MB page.
+	bool	huge = policy.hugePages != HUGEPAGE_NONE && bytes >= HUGE_PAGE_SIZE;
+	size_t	len = roundUp(bytes, huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE));
+	void	*p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (huge && policy.hugePages == HUGEPAGE_EXPLICIT)
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		// THP wants a 2 MB aligned start, so over-map and trim both ends
+		size_t	extra = huge ? HUGE_PAGE_SIZE : 0;
+		char	*raw = (char *)mmap(NULL, len + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED)
+			throw bad_alloc();
+		char	*start = (char *)roundUp((size_t)raw, huge ? HUGE_PAGE_SIZE : 1);
+		if (start > raw)
+			munmap(raw, start - raw);
+		if (raw + len + extra > start + len)
+			munmap(start + len, raw + len + extra - (start + len));
+#ifdef MADV_HUGEPAGE
+		if (huge)
+			madvise(start, len, MADV_HUGEPAGE);
+#endif
+		p = start;
+	}
+
+	// Pages of a fresh anonymous mapping are not backed yet, so the policy
+	// applies to every page as it is faulted in.
+	int nodes = nodeCount();
+	if (nodes > 1) {
+		if (policy.placement == ALLOC_INTERLEAVE)
+			setNodePolicy(p, len, NN_MPOL_INTERLEAVE, (nodes == 64 ? ~0UL : (1UL << nodes) - 1), 0);
+		else if (policy.placement == ALLOC_REPLICATE)
+			setNodePolicy(p, len, NN_MPOL_BIND, 1UL << (node % nodes), 0);
+	}
+
+	mapped = len;
+	return p;
+}
+
+void	Allocator::release(void *ptr, size_t mapped) {
+	if (!ptr)
+		return;
+	if (mapped == 0)
+		free(ptr);
+	else
+		munmap(ptr, mapped);
+}
+
+void	Allocator::bindToNode(void *ptr, size_t mapped, int node) {
+	// Heap buffers are not page aligned and may share pages with other data
+	if (!ptr || mapped == 0 || nodeCount() < 2)
+		return;
+	setNodePolicy(ptr, mapped, NN_MPOL_BIND, 1UL << (node % nodeCount()), NN_MPOL_MF_MOVE);
+}
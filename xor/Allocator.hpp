@@ -0,0 +1,48 @@
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+
+#include <cstddef>
+
+using namespace std;
+
+// Where the pages of a buffer should live on a multi-socket host.
+enum AllocationPolicy {
+	ALLOC_DEFAULT,		// plain heap, whatever the kernel decides
+	ALLOC_INTERLEAVE,	// pages spread round-robin over every NUMA node
+	ALLOC_FIRST_TOUCH,	// pages land on the node of the thread that first writes them
+	ALLOC_REPLICATE		// one full copy per NUMA node, reads served from the local one
+};
+
+enum HugePageMode {
+	HUGEPAGE_NONE,
+	HUGEPAGE_TRANSPARENT,	// madvise(MADV_HUGEPAGE), kernel promotes to 2 MB pages
+	HUGEPAGE_EXPLICIT		// MAP_HUGETLB from the reserved pool, falls back to transparent
+};
+
+struct MemoryPolicy {
+	AllocationPolicy	placement;
+	HugePageMode		hugePages;
+
+	MemoryPolicy() : placement(ALLOC_DEFAULT), hugePages(HUGEPAGE_NONE) { }
+	MemoryPolicy(AllocationPolicy p, HugePageMode h) : placement(p), hugePages(h) { }
+};
+
+class Allocator {
+	public:
+		static const size_t	HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+		static const size_t	ALIGNMENT = 64;
+
+		// Returns a zeroed buffer of at least `bytes`. `node` is only used by
+		// ALLOC_REPLICATE to pick the node a replica is bound to. The real size
+		// of the mapping is written to `mapped` and must be given back to release().
+		static void	*allocate(size_t bytes, MemoryPolicy policy, int node, size_t &mapped);
+		static void	release(void *ptr, size_t mapped);
+
+		// Moves already touched pages to the node of the calling thread.
+		static void	bindToNode(void *ptr, size_t mapped, int node);
+
+		static int	nodeCount();
+		static int	currentNode();
+};
+
+#endif
@@ -0,0 +1,381 @@
+#include "Blas.hpp"
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+# include <immintrin.h>
+# define NN_AVX 1
+#endif
+
+// Worker threads kept for the whole run, so a parallel call costs a wake-up
+// instead of creating and joining threads every time (trainBatch makes
+// several calls per layer and batch). run() hands chunks out to the workers
+// and the caller alike and returns once all of them are done. A second
+// caller arriving while the pool is busy runs its chunks itself.
+class ChunkPool {
+	private:
+		mutex						lock;
+		mutex						busy;
+		condition_variable			wake;
+		condition_variable			done;
+		vector<thread>				workers;
+		const function<void(int)>	*job;
+		int							count;
+		int							next;
+		int							pending;
+		unsigned					generation;
+		bool						stopping;
+
+		// Runs chunks of the current job until none are left; lock is held on entry and exit
+		void	work(unique_lock<mutex> &guard) {
+			while (this->next < this->count) {
+				int c = this->next++;
+				guard.unlock();
+				(*this->job)(c);
+				guard.lock();
+				if (--this->pending == 0) {
+					this->done.notify_all();
+				}
+			}
+		}
+
+		void	loop() {
+			unique_lock<mutex>	guard(this->lock);
+			unsigned			seen = this->generation;
+
+			for (;;) {
+				while (!this->stopping && this->generation == seen) {
+					this->wake.wait(guard);
+				}
+				if (this->stopping) {
+					return;
+				}
+				seen = this->generation;
+				this->work(guard);
+			}
+		}
+
+		void	stop() {
+			{
+				lock_guard<mutex> guard(this->lock);
+				this->stopping = true;
+			}
+			this->wake.notify_all();
+			for (size_t i = 0; i < this->workers.size(); i++) {
+				this->workers[i].join();
+			}
+			this->workers.clear();
+			this->stopping = false;
+		}
+	public:
+		ChunkPool() : job(NULL), count(0), next(0), pending(0), generation(0), stopping(false) {}
+
+		~ChunkPool() {
+			this->stop();
+		}
+
+		void	resize(int n) {
+			lock_guard<mutex> running(this->busy);
+
+			if ((size_t)n == this->workers.size()) {
+				return;
+			}
+			this->stop();
+			for (int i = 0; i < n; i++) {
+				this->workers.emplace_back(&ChunkPool::loop, this);
+			}
+		}
+
+		void	run(int chunks, const function<void(int)> &f) {
+			unique_lock<mutex> running(this->busy, try_to_lock);
+
+			if (!running.owns_lock() || this->workers.empty()) {
+				for (int c = 0; c < chunks; c++) {
+					f(c);
+				}
+				return;
+			}
+			unique_lock<mutex> guard(this->lock);
+			this->job = &f;
+			this->count = chunks;
+			this->next = 0;
+			this->pending = chunks;
+			this->generation++;
+			this->wake.notify_all();
+			this->work(guard);
+			while (this->pending > 0) {
+				this->done.wait(guard);
+			}
+			this->job = NULL;
+		}
+};
+
+static ChunkPool	pool;
+
+int	Blas::threads = 1;
+
+void	Blas::setThreads(int n) {
+	if (n <= 0) {
+		n = (int)thread::hardware_concurrency();
+	}
+	threads = n > 0 ? n : 1;
+	pool.resize(threads - 1);
+}
+
+int	Blas::getThreads() {
+	return threads;
+}
+
+// Runs f(begin, end, chunk) over [0, n), on the pool's threads when the work
+// is big enough. `cost` is the number of values touched, used against the
+// threshold. Chunk boundaries are kept on multiples of 8 so every thread
+// starts aligned.
+template <typename F>
+static int	forChunks(size_t n, size_t cost, F f) {
+	int t = Blas::getThreads();
+
+	if (t <= 1 || cost < Blas::PARALLEL_THRESHOLD || n < 16) {
+		f(0, n, 0);
+		return 1;
+	}
+	if ((size_t)t > n / 8) {
+		t = (int)(n / 8);
+	}
+	size_t step = ((n + t - 1) / t + 7) / 8 * 8;
+	int chunks = (int)((n + step - 1) / step);
+
+	pool.run(chunks, [&](int c) {
+		size_t begin = (size_t)c * step;
+		f(begin, begin + step < n ? begin + step : n, c);
+	});
+	return chunks;
+}
+
+#ifdef NN_AVX
+static double	hsum(__m256d v) {
+	__m128d lo = _mm256_castpd256_pd128(v);
+	__m128d hi = _mm256_extractf128_pd(v, 1);
+	lo = _mm_add_pd(lo, hi);
+	return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+static double	hmax(__m256d v) {
+	__m128d lo = _mm256_castpd256_pd128(v);
+	__m128d hi = _mm256_extractf128_pd(v, 1);
+	lo = _mm_max_pd(lo, hi);
+	return _mm_cvtsd_f64(_mm_max_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+#endif
+
+static void	axpyKernel(size_t n, double a, const double *x, double *y) {
+	size_t i = 0;
+#ifdef NN_AVX
+	__m256d va = _mm256_set1_pd(a);
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+		_mm256_storeu_pd(y + i + 4, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+	}
+#endif
+	for (; i < n; i++) {
+		y[i] += a * x[i];
+	}
+}
+
+static void	scalKernel(size_t n, double a, double *x) {
+	size_t i = 0;
+#ifdef NN_AVX
+	__m256d va = _mm256_set1_pd(a);
+	for (; i + 4 <= n; i += 4) {
+		_mm256_storeu_pd(x + i, _mm256_mul_pd(va, _mm256_loadu_pd(x + i)));
+	}
+#endif
+	for (; i < n; i++) {
+		x[i] *= a;
+	}
+}
+
+static void	shiftKernel(size_t n, double a, double *x) {
+	size_t i = 0;
+#ifdef NN_AVX
+	__m256d va = _mm256_set1_pd(a);
+	for (; i + 4 <= n; i += 4) {
+		_mm256_storeu_pd(x + i, _mm256_add_pd(va, _mm256_loadu_pd(x + i)));
+	}
+#endif
+	for (; i < n; i++) {
+		x[i] += a;
+	}
+}
+
+static void	hadamardKernel(size_t n, const double *x, double *y) {
+	size_t i = 0;
+#ifdef NN_AVX
+	for (; i + 4 <= n; i += 4) {
+		_mm256_storeu_pd(y + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+	}
+#endif
+	for (; i < n; i++) {
+		y[i] *= x[i];
+	}
+}
+
+static double	sumKernel(size_t n, const double *x) {
+	size_t i = 0;
+	double s = 0;
+#ifdef NN_AVX
+	__m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+	for (; i + 8 <= n; i += 8) {
+		a0 = _mm256_add_pd(a0, _mm256_loadu_pd(x + i));
+		a1 = _mm256_add_pd(a1, _mm256_loadu_pd(x + i + 4));
+	}
+	s = hsum(_mm256_add_pd(a0, a1));
+#endif
+	for (; i < n; i++) {
+		s += x[i];
+	}
+	return s;
+}
+
+static double	maxKernel(size_t n, const double *x) {
+	size_t i = 0;
+	double m = -INFINITY;
+#ifdef NN_AVX
+	if (n >= 4) {
+		__m256d a = _mm256_loadu_pd(x);
+		for (i = 4; i + 4 <= n; i += 4) {
+			a = _mm256_max_pd(a, _mm256_loadu_pd(x + i));
+		}
+		m = hmax(a);
+	}
+#endif
+	for (; i < n; i++) {
+		if (x[i] > m) {
+			m = x[i];
+		}
+	}
+	return m;
+}
+
+static double	dotKernel(size_t n, const double *x, const double *y) {
+	size_t i = 0;
+	double s = 0;
+#ifdef NN_AVX
+	__m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+	__m256d a2 = _mm256_setzero_pd(), a3 = _mm256_setzero_pd();
+	for (; i + 16 <= n; i += 16) {
+		a0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), a0);
+		a1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4), a1);
+		a2 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 8), _mm256_loadu_pd(y + i + 8), a2);
+		a3 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 12), _mm256_loadu_pd(y + i + 12), a3);
+	}
+	for (; i + 4 <= n; i += 4) {
+		a0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), a0);
+	}
+	s = hsum(_mm256_add_pd(_mm256_add_pd(a0, a1), _mm256_add_pd(a2, a3)));
+#endif
+	for (; i < n; i++) {
+		s += x[i] * y[i];
+	}
+	return s;
+}
+
+void	Blas::axpy(size_t n, double a, const double *x, double *y) {
+	forChunks(n, n, [=](size_t b, size_t e, int) { axpyKernel(e - b, a, x + b, y + b); });
+}
+
+void	Blas::scal(size_t n, double a, double *x) {
+	forChunks(n, n, [=](size_t b, size_t e, int) { scalKernel(e - b, a, x + b); });
+}
+
+void	Blas::hadamard(size_t n, const double *x, double *y) {
+	forChunks(n, n, [=](size_t b, size_t e, int) { hadamardKernel(e - b, x + b, y + b); });
+}
+
+void	Blas::add(size_t n, const double *x, double *y) {
+	forChunks(n, n, [=](size_t b, size_t e, int) { axpyKernel(e - b, 1.0, x + b, y + b); });
+}
+
+void	Blas::sub(size_t n, const double *x, double *y) {
+	forChunks(n, n, [=](size_t b, size_t e, int) { axpyKernel(e - b, -1.0, x + b, y + b); });
+}
+
+void	Blas::addRow(size_t rows, size_t cols, double a, const double *v, double *m) {
+	forChunks(rows, rows * cols, [=](size_t b, size_t e, int) {
+		for (size_t r = b; r < e; r++) {
+			axpyKernel(cols, a, v, m + r * cols);
+		}
+	});
+}
+
+void	Blas::addCol(size_t rows, size_t cols, double a, const double *v, double *m) {
+	forChunks(rows, rows * cols, [=](size_t b, size_t e, int) {
+		for (size_t r = b; r < e; r++) {
+			shiftKernel(cols, a * v[r], m + r * cols);
+		}
+	});
+}
+
+double	Blas::sum(size_t n, const double *x) {
+	vector<double> partial(threads, 0);
+	int chunks = forChunks(n, n, [&](size_t b, size_t e, int c) { partial[c] = sumKernel(e - b, x + b); });
+	return sumKernel(chunks, partial.data());
+}
+
+double	Blas::max(size_t n, const double *x) {
+	vector<double> partial(threads, -INFINITY);
+	int chunks = forChunks(n, n, [&](size_t b, size_t e, int c) { partial[c] = maxKernel(e - b, x + b); });
+	return maxKernel(chunks, partial.data());
+}
+
+size_t	Blas::argmax(size_t n, const double *x) {
+	// Vector max first, then a cheap scan for the first position holding it
+	double m = Blas::max(n, x);
+
+	for (size_t i = 0; i < n; i++) {
+		if (x[i] == m) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+double	Blas::dot(size_t n, const double *x, const double *y) {
+	vector<double> partial(threads, 0);
+	int chunks = forChunks(n, 2 * n, [&](size_t b, size_t e, int c) { partial[c] = dotKernel(e - b, x + b, y + b); });
+	return sumKernel(chunks, partial.data());
+}
+
+double	Blas::norm(size_t n, const double *x) {
+	return sqrt(Blas::dot(n, x, x));
+}
+
+void	Blas::gemv(bool trans, size_t rows, size_t cols, double alpha, const double *A,
+			size_t lda, const double *x, double beta, double *y) {
+	if (!trans) {
+		// Every output is an independent dot product over one row of A
+		forChunks(rows, rows * cols, [=](size_t b, size_t e, int) {
+			for (size_t r = b; r < e; r++) {
+				double d = alpha * dotKernel(cols, A + r * lda, x);
+				y[r] = beta == 0 ? d : d + beta * y[r];
+			}
+		});
+		return;
+	}
+	// y is cols long: stream the rows of A once, each thread owning a slice of y
+	forChunks(cols, rows * cols, [=](size_t b, size_t e, int) {
+		if (beta == 0) {
+			for (size_t c = b; c < e; c++) {
+				y[c] = 0;
+			}
+		} else if (beta != 1) {
+			scalKernel(e - b, beta, y + b);
+		}
+		for (size_t r = 0; r < rows; r++) {
+			axpyKernel(e - b, alpha * x[r], A + r * lda + b, y + b);
+		}
+	});
+}
@@ -0,0 +1,44 @@
+#ifndef BLAS_HPP
+#define BLAS_HPP
+
+#include <cstddef>
+
+using namespace std;
+
+// Level-1/2 kernels on raw contiguous double buffers. They are SIMD
+// (AVX2/FMA when the compiler targets it) and split the work over
+// several threads once a call touches more than PARALLEL_THRESHOLD values.
+class Blas {
+	private:
+		static int	threads;
+	public:
+		static const size_t	PARALLEL_THRESHOLD = 1 << 16;
+
+		// 0 means one thread per hardware core, 1 (the default) disables threading.
+		// Starts (or resizes) the worker pool the kernels share, call it at startup.
+		static void	setThreads(int n);
+		static int	getThreads();
+
+		static void		axpy(size_t n, double a, const double *x, double *y);	// y += a * x
+		static void		scal(size_t n, double a, double *x);					// x *= a
+		static void		hadamard(size_t n, const double *x, double *y);		// y *= x
+		static void		add(size_t n, const double *x, double *y);				// y += x
+		static void		sub(size_t n, const double *x, double *y);				// y -= x
+
+		// m is rows x cols row-major; v has cols (row broadcast) or rows (column broadcast) values
+		static void		addRow(size_t rows, size_t cols, double a, const double *v, double *m);
+		static void		addCol(size_t rows, size_t cols, double a, const double *v, double *m);
+
+		static double	sum(size_t n, const double *x);
+		static double	max(size_t n, const double *x);
+		static size_t	argmax(size_t n, const double *x);
+		static double	dot(size_t n, const double *x, const double *y);
+		static double	norm(size_t n, const double *x);
+
+		// y = alpha * op(A) * x + beta * y, A is rows x cols row-major with
+		// leading dimension lda; op(A) is A^T when trans is set.
+		static void		gemv(bool trans, size_t rows, size_t cols, double alpha, const double *A,
+							size_t lda, const double *x, double beta, double *y);
+};
+
+#endif
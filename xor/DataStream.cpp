@@ -0,0 +1,363 @@
+#include "DataStream.hpp"
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const double	pow10Table[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Number parser, much cheaper than strtod on the hot path. A mantissa of at
+// most 2^53 and a power of ten within 1e22 are both exact doubles, so the
+// result is one correctly rounded multiply or divide; anything else (more
+// significant digits, larger exponents) goes to strtod.
+static const char	*parseNumber(const char *p, const char *end, double &out) {
+	bool		negative = false;
+	uint64_t	mantissa = 0;
+	int			digits = 0;
+	int			exponent = 0;
+	const char	*start;
+	const char	*token;
+
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	token = p;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p++ == '-';
+	}
+	start = p;
+	for (; p < end && (unsigned)(*p - '0') < 10; p++) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			digits += mantissa != 0;
+		} else {
+			exponent++;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && (unsigned)(*p - '0') < 10; p++) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				digits += mantissa != 0;
+				exponent--;
+			}
+		}
+	}
+	if (p == start || (p == start + 1 && *start == '.')) {
+		return NULL;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		bool	negExp = false;
+		int		e = 0;
+
+		p++;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negExp = *p++ == '-';
+		}
+		if (p == end || (unsigned)(*p - '0') >= 10) {
+			return NULL;
+		}
+		for (; p < end && (unsigned)(*p - '0') < 10; p++) {
+			if (e < 10000) {
+				e = e * 10 + (*p - '0');
+			}
+		}
+		exponent += negExp ? -e : e;
+	}
+
+	if (mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+		double v = (double)mantissa;
+		v = exponent >= 0 ? v * pow10Table[exponent] : v / pow10Table[-exponent];
+		out = negative ? -v : v;
+	} else {
+		// The buffer is not terminated, strtod gets a copy of the token
+		string copy(token, p);
+		out = strtod(copy.c_str(), NULL);
+	}
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	return p;
+}
+
+DataStream::DataStream(const string &path, int inputCount, int outputCount, int batchSize, int queueDepth) {
+	this->path = path;
+	this->inputCount = inputCount;
+	this->outputCount = outputCount;
+	this->batchSize = batchSize > 0 ? batchSize : 1;
+	this->queueDepth = queueDepth > 0 ? queueDepth : 1;
+	this->current = NULL;
+	this->finished = false;
+	this->stopping = false;
+	this->bytesRead = 0;
+
+	// One batch being filled, queueDepth waiting, one held by the consumer
+	for (size_t i = 0; i < this->queueDepth + 2; i++) {
+		Batch *b = new Batch();
+		b->inputs.resize((size_t)this->batchSize * inputCount);
+		b->targets.resize((size_t)this->batchSize * outputCount);
+		b->size = 0;
+		this->freeBatches.emplace_back(b);
+	}
+	this->producer = thread(&DataStream::run, this);
+}
+
+DataStream::~DataStream() {
+	this->stop();
+	for (size_t i = 0; i < this->freeBatches.size(); i++) {
+		delete this->freeBatches[i];
+	}
+}
+
+void	DataStream::stop() {
+	{
+		unique_lock<mutex> guard(this->lock);
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+	if (this->producer.joinable()) {
+		this->producer.join();
+	}
+	// Every batch goes back to the free list
+	while (!this->ready.empty()) {
+		this->freeBatches.emplace_back(this->ready.front());
+		this->ready.pop_front();
+	}
+	if (this->current) {
+		this->freeBatches.emplace_back(this->current);
+		this->current = NULL;
+	}
+}
+
+void	DataStream::rewind() {
+	this->stop();
+	this->stopping = false;
+	this->finished = false;
+	this->error.clear();
+	this->bytesRead = 0;
+	this->producer = thread(&DataStream::run, this);
+}
+
+size_t	DataStream::getBytesRead() {
+	return this->bytesRead;
+}
+
+const Batch	*DataStream::next() {
+	unique_lock<mutex> guard(this->lock);
+
+	if (this->current) {
+		this->freeBatches.emplace_back(this->current);
+		this->current = NULL;
+		this->changed.notify_all();
+	}
+	while (this->ready.empty() && !this->finished) {
+		this->changed.wait(guard);
+	}
+	if (!this->ready.empty()) {
+		this->current = this->ready.front();
+		this->ready.pop_front();
+		this->changed.notify_all();
+		return this->current;
+	}
+	if (!this->error.empty()) {
+		throw runtime_error(this->error);
+	}
+	return NULL;
+}
+
+// Hands a full batch to the consumer and swaps in an empty one.
+// Returns false when the stream is being stopped.
+bool	DataStream::push(Batch *&batch) {
+	unique_lock<mutex> guard(this->lock);
+
+	while (!this->stopping && (this->ready.size() >= this->queueDepth || this->freeBatches.empty())) {
+		this->changed.wait(guard);
+	}
+	if (this->stopping) {
+		this->freeBatches.emplace_back(batch);
+		batch = NULL;
+		return false;
+	}
+	this->ready.emplace_back(batch);
+	batch = this->freeBatches.back();
+	this->freeBatches.pop_back();
+	batch->size = 0;
+	this->changed.notify_all();
+	return true;
+}
+
+void	DataStream::finish(const string &message) {
+	unique_lock<mutex> guard(this->lock);
+
+	this->error = message;
+	this->finished = true;
+	this->changed.notify_all();
+}
+
+void	DataStream::run() {
+	int fd = open(this->path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		this->finish("Could not open " + this->path);
+		return;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	vector<char>	buffer(CHUNK_SIZE + 4096);
+	size_t			filled = 0;
+	ssize_t			n = 0;
+
+	while (filled < 12 && (n = read(fd, buffer.data() + filled, CHUNK_SIZE - filled)) > 0) {
+		filled += n;
+	}
+	this->bytesRead += filled;
+	if (filled >= 4 && memcmp(buffer.data(), "NNB1", 4) == 0) {
+		this->readBinary(fd, buffer, filled);
+	} else {
+		this->readCsv(fd, buffer, filled);
+	}
+	close(fd);
+}
+
+void	DataStream::readBinary(int fd, vector<char> &buffer, size_t filled) {
+	uint32_t	header[2];
+	size_t		record = (size_t)(this->inputCount + this->outputCount) * sizeof(double);
+	size_t		offset = 12;
+	Batch		*batch;
+
+	if (filled < 12) {
+		this->finish("Truncated header in " + this->path);
+		return;
+	}
+	memcpy(header, buffer.data() + 4, sizeof(header));
+	if ((int)header[0] != this->inputCount || (int)header[1] != this->outputCount) {
+		this->finish("Sample shape in " + this->path + " does not match the network");
+		return;
+	}
+	{
+		unique_lock<mutex> guard(this->lock);
+		batch = this->freeBatches.back();
+		this->freeBatches.pop_back();
+		batch->size = 0;
+	}
+
+	for (;;) {
+		while (filled - offset >= record) {
+			const char *src = buffer.data() + offset;
+			memcpy(&batch->inputs[(size_t)batch->size * this->inputCount], src, this->inputCount * sizeof(double));
+			memcpy(&batch->targets[(size_t)batch->size * this->outputCount], src + this->inputCount * sizeof(double),
+				this->outputCount * sizeof(double));
+			offset += record;
+			if (++batch->size == this->batchSize && !this->push(batch)) {
+				return;
+			}
+		}
+		// Carry the partial record over and refill the rest of the chunk
+		memmove(buffer.data(), buffer.data() + offset, filled - offset);
+		filled -= offset;
+		offset = 0;
+		if (buffer.size() < record + CHUNK_SIZE) {
+			buffer.resize(record + CHUNK_SIZE);
+		}
+		ssize_t n = read(fd, buffer.data() + filled, CHUNK_SIZE);
+		if (n <= 0) {
+			break;
+		}
+		filled += n;
+		this->bytesRead += n;
+	}
+	if (batch->size > 0 && !this->push(batch)) {
+		return;
+	}
+	this->finish(filled ? "Trailing partial sample in " + this->path : "");
+	unique_lock<mutex> guard(this->lock);
+	this->freeBatches.emplace_back(batch);
+}
+
+void	DataStream::readCsv(int fd, vector<char> &buffer, size_t filled) {
+	int		columns = this->inputCount + this->outputCount;
+	size_t	lineNumber = 0;
+	size_t	offset = 0;
+	bool	eof = false;
+	Batch	*batch;
+
+	{
+		unique_lock<mutex> guard(this->lock);
+		batch = this->freeBatches.back();
+		this->freeBatches.pop_back();
+		batch->size = 0;
+	}
+
+	for (;;) {
+		const char *p = buffer.data() + offset;
+		const char *end = buffer.data() + filled;
+
+		for (;;) {
+			// memchr is the SIMD part: it scans 16-64 bytes per step for the line end
+			const char *nl = (const char *)memchr(p, '\n', end - p);
+			if (!nl) {
+				if (!eof || p == end) {
+					break;
+				}
+				nl = end;
+			}
+			const char *lineEnd = nl;
+			if (lineEnd > p && lineEnd[-1] == '\r') {
+				lineEnd--;
+			}
+			lineNumber++;
+
+			if (lineEnd > p && *p != '#') {
+				double		*in = &batch->inputs[(size_t)batch->size * this->inputCount];
+				double		*out = &batch->targets[(size_t)batch->size * this->outputCount];
+				const char	*q = p;
+
+				for (int c = 0; c < columns; c++) {
+					q = parseNumber(q, lineEnd, c < this->inputCount ? in[c] : out[c - this->inputCount]);
+					if (!q || (c + 1 < columns ? (q == lineEnd || *q != ',') : q != lineEnd)) {
+						this->finish("Malformed CSV line " + to_string(lineNumber) + " in " + this->path);
+						unique_lock<mutex> guard(this->lock);
+						this->freeBatches.emplace_back(batch);
+						return;
+					}
+					q++;
+				}
+				if (++batch->size == this->batchSize && !this->push(batch)) {
+					return;
+				}
+			}
+			p = nl < end ? nl + 1 : end;
+		}
+		if (eof) {
+			break;
+		}
+
+		// Keep the unfinished line at the front of the buffer and read after it
+		size_t rest = end - p;
+		memmove(buffer.data(), p, rest);
+		filled = rest;
+		offset = 0;
+		if (buffer.size() < rest + CHUNK_SIZE) {
+			buffer.resize(rest + CHUNK_SIZE);
+		}
+		ssize_t n = read(fd, buffer.data() + filled, CHUNK_SIZE);
+		if (n <= 0) {
+			eof = true;
+		} else {
+			filled += n;
+			this->bytesRead += n;
+		}
+	}
+	if (batch->size > 0 && !this->push(batch)) {
+		return;
+	}
+	this->finish("");
+	unique_lock<mutex> guard(this->lock);
+	this->freeBatches.emplace_back(batch);
+}
@@ -0,0 +1,70 @@
+#ifndef DATASTREAM_HPP
+#define DATASTREAM_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace std;
+
+// One mini-batch, row-major: inputs is size x inputCount, targets size x outputCount
+struct Batch {
+	vector<double>	inputs;
+	vector<double>	targets;
+	int				size;
+};
+
+// Streams samples from a file far larger than RAM. A background thread reads
+// the file in fixed chunks, parses them and fills a small bounded queue of
+// batches, so the next chunk is loading while the network trains on the
+// current one.
+//
+// Two formats are recognised:
+//  - numeric CSV, one sample per line: the inputs then the targets,
+//    separated by commas (lines starting with '#' are skipped)
+//  - packed binary: the 4 bytes "NNB1", uint32 input count, uint32 output
+//    count, then every sample as (inputs + outputs) little-endian doubles
+class DataStream {
+	private:
+		string				path;
+		int					inputCount;
+		int					outputCount;
+		int					batchSize;
+		size_t				queueDepth;
+
+		thread				producer;
+		mutex				lock;
+		condition_variable	changed;
+		deque<Batch *>		ready;
+		vector<Batch *>		freeBatches;
+		Batch				*current;
+		bool				finished;
+		bool				stopping;
+		string				error;
+		atomic<size_t>		bytesRead;
+
+		void	run();
+		void	readBinary(int fd, vector<char> &buffer, size_t filled);
+		void	readCsv(int fd, vector<char> &buffer, size_t filled);
+		bool	push(Batch *&batch);
+		void	finish(const string &message);
+		void	stop();
+	public:
+		static const size_t	CHUNK_SIZE = 8 * 1024 * 1024;
+
+		DataStream(const string &path, int inputCount, int outputCount, int batchSize, int queueDepth);
+		~DataStream();
+
+		// Restarts the stream from the first sample, for the next epoch
+		void			rewind();
+		// Waits for the next batch; returns NULL once the file is exhausted.
+		// The batch stays valid until the following call.
+		const Batch		*next();
+		size_t			getBytesRead();
+};
+
+#endif
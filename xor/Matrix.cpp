@@ -1,10 +1,14 @@
 // # include "Layer.hpp"
 # include "Matrix.hpp"
 #include <random>
+#include <cstring>
+#include <stdexcept>
+#include "Blas.hpp"
 
 Matrix::Matrix() {
 	this->rows = 0;
 	this->cols = 0;
+	this->mapped = 0;
 }
 
 int	Matrix::getCols() {
@@ -15,20 +19,39 @@ int	Matrix::getRows() {
 	return this->rows;
 }
 
-Matrix::Matrix(int rows, int cols, bool isRandom) {
+Matrix::Matrix(int rows, int cols, bool isRandom) : Matrix(rows, cols, isRandom, MemoryPolicy()) { }
+
+Matrix::Matrix(int rows, int cols, bool isRandom, MemoryPolicy policy) {
 	this->rows = rows;
 	this->cols = cols;
+	this->policy = policy;
+	this->allocate();
 	
-	for (int i = 0; i < rows; i++) {
-		vector<double> row;
-		for (int j = 0; j < cols; j++) {
-			if (isRandom) {
-				row.emplace_back(this->generateRandomValue());
-			} else {
-				row.emplace_back(0.00);
-			}
+	// With ALLOC_FIRST_TOUCH these writes decide where the pages live, so
+	// build the matrix on the thread that is going to use it.
+	if (isRandom) {
+		double *m = this->getData();
+		for (int i = 0; i < rows * cols; i++) {
+			m[i] = this->generateRandomValue();
 		}
-		this->matrix.emplace_back(row);
+		this->commit();
+	}
+}
+
+void	Matrix::allocate() {
+	size_t	bytes = (size_t)this->rows * this->cols * sizeof(double);
+	int		copies = this->policy.placement == ALLOC_REPLICATE ? Allocator::nodeCount() : 1;
+	
+	for (int n = 0; n < copies; n++) {
+		this->replicas.emplace_back((double *)Allocator::allocate(bytes, this->policy, n, this->mapped));
+	}
+}
+
+void	Matrix::syncReplicas() {
+	size_t bytes = (size_t)this->rows * this->cols * sizeof(double);
+	
+	for (size_t n = 1; n < this->replicas.size(); n++) {
+		memcpy(this->replicas[n], this->replicas[0], bytes);
 	}
 }
 
@@ -50,7 +73,7 @@ double	Matrix::generateRandomValue() {
 }
 
 Matrix *Matrix::transpose() {
-	Matrix *m = new Matrix(this->cols, this->rows, false);
+	Matrix *m = new Matrix(this->cols, this->rows, false, this->policy);
 	
 	for (int i = 0; i < this->rows; i++) {
 		for (int j = 0; j < this->cols; j++) {
@@ -62,13 +85,150 @@ Matrix *Matrix::transpose() {
 }
 
 void	Matrix::setValue(int r, int c, double v) {
-	matrix[r][c] = v;
+	for (size_t n = 0; n < this->replicas.size(); n++) {
+		this->replicas[n][r * this->cols + c] = v;
+	}
 }
 
 double	Matrix::getValue(int r, int c) {
-	return matrix[r][c];
+	return this->getLocalData()[r * this->cols + c];
+}
+
+const double	*Matrix::getLocalData() {
+	if (this->replicas.size() > 1) {
+		return this->replicas[Allocator::currentNode() % this->replicas.size()];
+	}
+	return this->replicas.empty() ? NULL : this->replicas[0];
+}
+
+double	*Matrix::getData() {
+	return this->replicas.empty() ? NULL : this->replicas[0];
+}
+
+void	Matrix::commit() {
+	this->syncReplicas();
+}
+
+MemoryPolicy	Matrix::getPolicy() {
+	return this->policy;
+}
+
+void	Matrix::bindToCurrentNode() {
+	// Replicas are already bound one per node
+	if (this->policy.placement == ALLOC_REPLICATE) {
+		return;
+	}
+	for (size_t n = 0; n < this->replicas.size(); n++) {
+		Allocator::bindToNode(this->replicas[n], this->mapped, Allocator::currentNode());
+	}
+}
+
+static void	checkSameShape(Matrix *a, Matrix *b) {
+	if (a->getRows() != b->getRows() || a->getCols() != b->getCols()) {
+		throw invalid_argument("Matrix shapes do not match");
+	}
+}
+
+void	Matrix::axpy(double a, Matrix *x) {
+	checkSameShape(this, x);
+	Blas::axpy((size_t)this->rows * this->cols, a, x->getLocalData(), this->getData());
+	this->commit();
+}
+
+void	Matrix::scal(double a) {
+	Blas::scal((size_t)this->rows * this->cols, a, this->getData());
+	this->commit();
+}
+
+void	Matrix::hadamard(Matrix *x) {
+	checkSameShape(this, x);
+	Blas::hadamard((size_t)this->rows * this->cols, x->getLocalData(), this->getData());
+	this->commit();
+}
+
+void	Matrix::add(Matrix *x) {
+	checkSameShape(this, x);
+	Blas::add((size_t)this->rows * this->cols, x->getLocalData(), this->getData());
+	this->commit();
+}
+
+void	Matrix::sub(Matrix *x) {
+	checkSameShape(this, x);
+	Blas::sub((size_t)this->rows * this->cols, x->getLocalData(), this->getData());
+	this->commit();
+}
+
+void	Matrix::addRowVector(Matrix *v) {
+	if (v->getRows() * v->getCols() != this->cols) {
+		throw invalid_argument("Row vector length does not match the matrix columns");
+	}
+	Blas::addRow(this->rows, this->cols, 1.0, v->getLocalData(), this->getData());
+	this->commit();
+}
+
+void	Matrix::subRowVector(Matrix *v) {
+	if (v->getRows() * v->getCols() != this->cols) {
+		throw invalid_argument("Row vector length does not match the matrix columns");
+	}
+	Blas::addRow(this->rows, this->cols, -1.0, v->getLocalData(), this->getData());
+	this->commit();
+}
+
+void	Matrix::addColVector(Matrix *v) {
+	if (v->getRows() * v->getCols() != this->rows) {
+		throw invalid_argument("Column vector length does not match the matrix rows");
+	}
+	Blas::addCol(this->rows, this->cols, 1.0, v->getLocalData(), this->getData());
+	this->commit();
+}
+
+void	Matrix::subColVector(Matrix *v) {
+	if (v->getRows() * v->getCols() != this->rows) {
+		throw invalid_argument("Column vector length does not match the matrix rows");
+	}
+	Blas::addCol(this->rows, this->cols, -1.0, v->getLocalData(), this->getData());
+	this->commit();
+}
+
+void	Matrix::clipNorm(double maxNorm) {
+	double n = this->norm();
+	
+	if (n > maxNorm && n > 0) {
+		this->scal(maxNorm / n);
+	}
+}
+
+double	Matrix::sum() {
+	return Blas::sum((size_t)this->rows * this->cols, this->getLocalData());
+}
+
+double	Matrix::max() {
+	return Blas::max((size_t)this->rows * this->cols, this->getLocalData());
+}
+
+int	Matrix::argmax() {
+	return (int)Blas::argmax((size_t)this->rows * this->cols, this->getLocalData());
+}
+
+double	Matrix::norm() {
+	return Blas::norm((size_t)this->rows * this->cols, this->getLocalData());
+}
+
+void	Matrix::gemv(bool trans, double alpha, Matrix *x, double beta, Matrix *y) {
+	int in = trans ? this->rows : this->cols;
+	int out = trans ? this->cols : this->rows;
+	
+	if (x->getRows() * x->getCols() != in || y->getRows() * y->getCols() != out) {
+		throw invalid_argument("gemv vector lengths do not match the matrix");
+	}
+	Blas::gemv(trans, this->rows, this->cols, alpha, this->getLocalData(), this->cols,
+		x->getLocalData(), beta, y->getData());
+	y->commit();
 }
 
 Matrix::~Matrix() {
+	for (size_t n = 0; n < this->replicas.size(); n++) {
+		Allocator::release(this->replicas[n], this->mapped);
+	}
 	cout << "Matrix destroyed" << endl;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <vector>
 #include <iostream> // IWYU pragma: keep
 #include <random> // IWYU pragma: keep
+#include "Allocator.hpp"
 
 using namespace std;
 
@@ -13,10 +14,21 @@ class Matrix {
 	int						cols;
 	// bool					isRandom;
 	
-	vector<vector<double>>	matrix;
+	// Row-major, rows * cols doubles. With ALLOC_REPLICATE there is one copy
+	// per NUMA node and replicas[0] is the one written first.
+	MemoryPolicy			policy;
+	size_t					mapped;
+	vector<double *>		replicas;
+
+	void	allocate();
+	void	syncReplicas();
+
+	Matrix(const Matrix &);
+	Matrix	&operator=(const Matrix &);
 	public:
 	Matrix();
 	Matrix(int rows, int cols, bool isRandom);
+	Matrix(int rows, int cols, bool isRandom, MemoryPolicy policy);
 	~Matrix();
 	Matrix	*transpose();
 	void	setValue(int r, int c, double v);
@@ -25,7 +37,38 @@ class Matrix {
 	int		getCols();
 	double	getValue(int r, int c);
 	double 	generateRandomValue();
+	
+	// getLocalData() is the copy on the calling thread's node, for reads.
+	// getData() is the primary copy; call commit() after writing through it
+	// so the other replicas follow.
+	const double	*getLocalData();
+	double			*getData();
+	void			commit();
+	MemoryPolicy	getPolicy();
+	void			bindToCurrentNode();
+	
+	// Vectorized element-wise updates, the argument must have the same shape
+	void	axpy(double a, Matrix *x);
+	void	scal(double a);
+	void	hadamard(Matrix *x);
+	void	add(Matrix *x);
+	void	sub(Matrix *x);
+	// v is 1 x cols (added to every row) or rows x 1 (added to every column)
+	void	addRowVector(Matrix *v);
+	void	subRowVector(Matrix *v);
+	void	addColVector(Matrix *v);
+	void	subColVector(Matrix *v);
+	// Rescales the whole matrix so its norm is at most maxNorm
+	void	clipNorm(double maxNorm);
+	
+	double	sum();
+	double	max();
+	int		argmax();
+	double	norm();
+	
+	// y = alpha * op(this) * x + beta * y, x and y are row or column vectors
+	void	gemv(bool trans, double alpha, Matrix *x, double beta, Matrix *y);
 };
 
 
-#endif
\ No newline at end of file
+#endif
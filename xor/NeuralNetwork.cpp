@@ -1,8 +1,14 @@
 #include "NeuralNetwork.hpp"
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+#include "Blas.hpp"
+#include "WeightsFile.hpp"
 
 NeuralNetwork::NeuralNetwork() { }
 
 NeuralNetwork::~NeuralNetwork() {
+	this->invalidateInference();
 	cout << "NeuralNetwork destroyed" << endl;
 }
 
@@ -14,8 +20,11 @@ void	NeuralNetwork::setCurrnetInput(vector<double> input) {
 	}
 }
 
-NeuralNetwork::NeuralNetwork(vector<int> topology) {
+NeuralNetwork::NeuralNetwork(vector<int> topology) : NeuralNetwork(topology, MemoryPolicy()) { }
+
+NeuralNetwork::NeuralNetwork(vector<int> topology, MemoryPolicy policy) {
 	this->topology = topology;//Config
+	this->memoryPolicy = policy;
 	
 	
 	for (int i = 0; i < topology.size(); i++) {
@@ -24,11 +33,66 @@ NeuralNetwork::NeuralNetwork(vector<int> topology) {
 	}
 	
 	for (int i = 0; i < topology.size() - 1; i++) {
-		Matrix *m = new Matrix(topology[i], topology[i + 1], true);
+		Matrix *m = new Matrix(topology[i], topology[i + 1], true, policy);
 		this->weightsMatrices.emplace_back(m);
 	}
 }
 
+vector<int>	NeuralNetwork::getTopology() {
+	return this->topology;
+}
+
+Matrix	*NeuralNetwork::getWeights(int layer) {
+	return this->weightsMatrices[layer];
+}
+
+void	NeuralNetwork::saveWeights(const string &path) {
+	vector<const double *> w;
+	
+	for (int i = 0; i < this->weightsMatrices.size(); i++) {
+		w.emplace_back(this->weightsMatrices[i]->getLocalData());
+	}
+	WeightsFile::write(path, this->topology, w);
+}
+
+void	NeuralNetwork::loadWeights(const string &path) {
+	vector<double *> w;
+	
+	for (int i = 0; i < this->weightsMatrices.size(); i++) {
+		w.emplace_back(this->weightsMatrices[i]->getData());
+	}
+	WeightsFile::read(path, this->topology, w);
+	for (int i = 0; i < this->weightsMatrices.size(); i++) {
+		this->weightsMatrices[i]->commit();
+	}
+	this->invalidateInference();
+}
+
+MemoryPolicy	NeuralNetwork::getMemoryPolicy() {
+	return this->memoryPolicy;
+}
+
+void	NeuralNetwork::setMemoryPolicy(MemoryPolicy policy) {
+	this->memoryPolicy = policy;
+	
+	for (int i = 0; i < this->weightsMatrices.size(); i++) {
+		Matrix *old = this->weightsMatrices[i];
+		Matrix *m = new Matrix(old->getRows(), old->getCols(), false, policy);
+		
+		memcpy(m->getData(), old->getLocalData(), (size_t)old->getRows() * old->getCols() * sizeof(double));
+		m->commit();
+		this->weightsMatrices[i] = m;
+		delete old;
+	}
+	this->invalidateInference();
+}
+
+void	NeuralNetwork::bindToCurrentNode() {
+	for (int i = 0; i < this->weightsMatrices.size(); i++) {
+		this->weightsMatrices[i]->bindToCurrentNode();
+	}
+}
+
 void	NeuralNetwork::print() {
 	for (int i = 0; i < this->layers.size(); i++) {
 		cout << "Layer:	" << i << endl;
@@ -45,4 +109,168 @@ void	NeuralNetwork::print() {
 	// 	this->weightsMatrices[i]->print();
 	// 	cout << endl;
 	// }
+}
+
+void	NeuralNetwork::invalidateInference() {
+	for (size_t n = 0; n < this->packedReplicas.size(); n++) {
+		Allocator::release(this->packedReplicas[n], this->packedMapped);
+	}
+	this->packedReplicas.clear();
+	this->packedMapped = 0;
+	this->packedOffsets.clear();
+	this->packedStrides.clear();
+}
+
+void	NeuralNetwork::packForInference() {
+	size_t total = 0;
+	
+	this->invalidateInference();
+	this->maxWidth = 0;
+	for (int i = 0; i < this->weightsMatrices.size(); i++) {
+		int in = this->weightsMatrices[i]->getRows();
+		int out = this->weightsMatrices[i]->getCols();
+		int stride = (in + 7) / 8 * 8;
+		
+		this->packedOffsets.emplace_back(total);
+		this->packedStrides.emplace_back(stride);
+		total += (size_t)out * stride;
+		this->maxWidth = max(this->maxWidth, max(in, out));
+	}
+	
+	// Same placement as the training weights, padding stays zero. The first
+	// copy is packed, the other replicas are copied from it.
+	size_t	bytes = total * sizeof(double);
+	int		copies = this->memoryPolicy.placement == ALLOC_REPLICATE ? Allocator::nodeCount() : 1;
+	
+	for (int n = 0; n < copies; n++) {
+		int node = copies > 1 ? n : Allocator::currentNode();
+		
+		this->packedReplicas.emplace_back((double *)Allocator::allocate(bytes, this->memoryPolicy, node,
+			this->packedMapped));
+	}
+	for (int i = 0; i < this->weightsMatrices.size(); i++) {
+		Matrix			*w = this->weightsMatrices[i];
+		const double	*src = w->getLocalData();
+		double			*dst = this->packedReplicas[0] + this->packedOffsets[i];
+		int				in = w->getRows();
+		int				out = w->getCols();
+		
+		for (int r = 0; r < in; r++) {
+			for (int c = 0; c < out; c++) {
+				dst[(size_t)c * this->packedStrides[i] + r] = src[(size_t)r * out + c];
+			}
+		}
+	}
+	for (size_t n = 1; n < this->packedReplicas.size(); n++) {
+		memcpy(this->packedReplicas[n], this->packedReplicas[0], bytes);
+	}
+}
+
+void	NeuralNetwork::predict(const double *input, double *output) {
+	// Two ping-pong buffers per thread, sized once for the widest layer
+	static thread_local vector<double> scratch;
+	
+	if (this->packedReplicas.empty()) {
+		this->packForInference();
+	}
+	if (scratch.size() < 2 * (size_t)this->maxWidth) {
+		scratch.resize(2 * this->maxWidth);
+	}
+	
+	const double	*x = input;
+	const double	*packed = this->packedReplicas[Allocator::currentNode() % this->packedReplicas.size()];
+	size_t			layerCount = this->packedOffsets.size();
+	
+	for (size_t i = 0; i < layerCount; i++) {
+		int		in = this->topology[i];
+		int		out = this->topology[i + 1];
+		double	*y = i + 1 == layerCount ? output : scratch.data() + (i % 2) * this->maxWidth;
+		
+		Blas::gemv(false, out, in, 1.0, packed + this->packedOffsets[i],
+			this->packedStrides[i], x, 0.0, y);
+		for (int j = 0; j < out; j++) {
+			y[j] = 1 / (1 + exp(-y[j]));
+		}
+		x = y;
+	}
+}
+
+vector<double>	NeuralNetwork::predict(const vector<double> &input) {
+	if (this->topology.size() < 2 || input.size() != (size_t)this->topology[0]) {
+		throw invalid_argument("Input size does not match the network topology");
+	}
+	vector<double> output(this->topology.back());
+	
+	this->predict(input.data(), output.data());
+	return output;
+}
+
+double	NeuralNetwork::trainBatch(const double *inputs, const double *targets, int batchSize, double learningRate) {
+	size_t					layerCount = this->weightsMatrices.size();
+	vector<vector<double> >	act(layerCount + 1);
+	vector<double>			delta, prevDelta, grad;
+	double					loss = 0;
+	
+	if (layerCount == 0 || batchSize <= 0) {
+		return 0;
+	}
+	
+	// Forward, keeping every activation of the batch for the backward pass
+	act[0].assign(inputs, inputs + (size_t)batchSize * this->topology[0]);
+	for (size_t l = 0; l < layerCount; l++) {
+		int				in = this->topology[l];
+		int				out = this->topology[l + 1];
+		const double	*w = this->weightsMatrices[l]->getLocalData();
+		
+		act[l + 1].resize((size_t)batchSize * out);
+		for (int b = 0; b < batchSize; b++) {
+			Blas::gemv(true, in, out, 1.0, w, out, &act[l][(size_t)b * in], 0.0, &act[l + 1][(size_t)b * out]);
+		}
+		for (size_t j = 0; j < act[l + 1].size(); j++) {
+			act[l + 1][j] = 1 / (1 + exp(-act[l + 1][j]));
+		}
+	}
+	
+	// Output error scaled by the sigmoid derivative
+	vector<double> &output = act[layerCount];
+	delta.resize(output.size());
+	for (size_t j = 0; j < output.size(); j++) {
+		double e = output[j] - targets[j];
+		loss += 0.5 * e * e;
+		delta[j] = e * output[j] * (1 - output[j]);
+	}
+	
+	for (size_t l = layerCount; l-- > 0; ) {
+		int		in = this->topology[l];
+		int		out = this->topology[l + 1];
+		Matrix	*w = this->weightsMatrices[l];
+		
+		// dW = sum over the batch of a_l^T * delta, one rank-1 update per sample
+		grad.assign((size_t)in * out, 0.0);
+		for (int b = 0; b < batchSize; b++) {
+			const double *a = &act[l][(size_t)b * in];
+			for (int r = 0; r < in; r++) {
+				Blas::axpy(out, a[r], &delta[(size_t)b * out], &grad[(size_t)r * out]);
+			}
+		}
+		
+		// Propagate before the weights move
+		if (l > 0) {
+			prevDelta.resize((size_t)batchSize * in);
+			for (int b = 0; b < batchSize; b++) {
+				Blas::gemv(false, in, out, 1.0, w->getLocalData(), out, &delta[(size_t)b * out], 0.0, &prevDelta[(size_t)b * in]);
+			}
+			Blas::hadamard(prevDelta.size(), act[l].data(), prevDelta.data());
+			for (size_t j = 0; j < prevDelta.size(); j++) {
+				prevDelta[j] *= 1 - act[l][j];
+			}
+			delta.swap(prevDelta);
+		}
+		
+		Blas::axpy(grad.size(), -learningRate / batchSize, grad.data(), w->getData());
+		w->commit();
+	}
+	
+	this->invalidateInference();
+	return loss / batchSize;
 }
\ No newline at end of file
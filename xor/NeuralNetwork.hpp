@@ -3,6 +3,7 @@
 
 #include <iostream> // IWYU pragma: keep
 #include <vector>
+#include <string>
 #include "Matrix.hpp" // IWYU pragma: keep
 #include "Layer.hpp" // IWYU pragma: keep
 
@@ -15,10 +16,22 @@ class NeuralNetwork {
 		vector<double> input;
 		vector<Layer *>		layers;
 		vector<Matrix *>	weightsMatrices;
+		MemoryPolicy		memoryPolicy;
+		
+		// Inference-only copy of the weights. Layer i is stored transposed
+		// (outputs x inputs), each row padded to a multiple of 8 doubles, so
+		// every output is one contiguous aligned dot product. One copy per
+		// node under ALLOC_REPLICATE, like the replicas of Matrix.
+		vector<double *>	packedReplicas;
+		size_t				packedMapped = 0;
+		vector<size_t>		packedOffsets;
+		vector<int>			packedStrides;
+		int					maxWidth = 0;
 	public:
 		NeuralNetwork();
 		NeuralNetwork(vector<double> input);
 		NeuralNetwork(vector<int> topology);
+		NeuralNetwork(vector<int> topology, MemoryPolicy policy);
 		~NeuralNetwork();
 		
 		void				feedForward(Matrix *input);
@@ -28,8 +41,32 @@ class NeuralNetwork {
 		void				setCurrnetInput(vector<double> input);
 		
 		vector<int>			getTopology();
+		Matrix				*getWeights(int layer);
+		
+		// Same file format as StaticNetwork::loadWeights, see WeightsFile.hpp
+		void				saveWeights(const string &path);
+		void				loadWeights(const string &path);
+		
+		// Reallocates the weights under the new policy, keeping their values
+		void				setMemoryPolicy(MemoryPolicy policy);
+		MemoryPolicy		getMemoryPolicy();
+		// Migrates the weights to the NUMA node of the calling worker
+		void				bindToCurrentNode();
+		
+		// Batch-size-1 inference: GEMV over the packed weights, no Layer or
+		// Neuron state is read or written. predict() packs lazily; call
+		// packForInference() up front before sharing the network between threads,
+		// and again (or invalidateInference()) whenever the weights change.
+		// Each call reads the replica of the caller's node.
+		void				packForInference();
+		void				invalidateInference();
+		void				predict(const double *input, double *output);
+		vector<double>		predict(const vector<double> &input);
 		
-			
+		// One SGD step on a mini-batch, sigmoid activations and squared error.
+		// inputs is batchSize x topology[0], targets batchSize x topology.back(),
+		// both row-major. Returns the mean loss of the batch.
+		double				trainBatch(const double *inputs, const double *targets, int batchSize, double learningRate);
 
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,140 @@
+#ifndef STATICNETWORK_HPP
+#define STATICNETWORK_HPP
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "WeightsFile.hpp"
+#include "NeuralNetwork.hpp"
+
+using namespace std;
+
+// Inference-only network whose topology is fixed at compile time, e.g.
+// StaticNetwork<3, 2, 3> for the {3, 2, 3} network of main.cpp. Every loop
+// bound is a constant, so the compiler unrolls and vectorizes each layer;
+// the weights are plain arrays inside the object, so it can live on the
+// stack or in static storage, and nothing is dispatched at run time.
+// It computes exactly what NeuralNetwork::predict() does for the same weights.
+
+template <int In, int Out>
+struct StaticLayer {
+	// Transposed (outputs x inputs) so every output is a contiguous dot product
+	double	weights[Out][In];
+
+	inline void	forward(const double *x, double *y) const {
+		for (int o = 0; o < Out; o++) {
+			double s = 0;
+			for (int i = 0; i < In; i++) {
+				s += weights[o][i] * x[i];
+			}
+			y[o] = 1 / (1 + exp(-s));
+		}
+	}
+
+	// src is (In x Out) row-major, as NeuralNetwork and WeightsFile store it
+	void	assign(const double *src) {
+		for (int i = 0; i < In; i++) {
+			for (int o = 0; o < Out; o++) {
+				weights[o][i] = src[i * Out + o];
+			}
+		}
+	}
+};
+
+template <int In, int Out, int... Rest>
+struct StaticLayers {
+	static const int	inputs = In;
+	static const int	outputs = StaticLayers<Out, Rest...>::outputs;
+	static const int	count = 1 + StaticLayers<Out, Rest...>::count;
+
+	StaticLayer<In, Out>		layer;
+	StaticLayers<Out, Rest...>	next;
+
+	inline void	forward(const double *x, double *y) const {
+		double h[Out];
+		layer.forward(x, h);
+		next.forward(h, y);
+	}
+
+	void	assign(const vector<const double *> &w, int i) {
+		layer.assign(w[i]);
+		next.assign(w, i + 1);
+	}
+};
+
+template <int In, int Out>
+struct StaticLayers<In, Out> {
+	static const int	inputs = In;
+	static const int	outputs = Out;
+	static const int	count = 1;
+
+	StaticLayer<In, Out>	layer;
+
+	inline void	forward(const double *x, double *y) const {
+		layer.forward(x, y);
+	}
+
+	void	assign(const vector<const double *> &w, int i) {
+		layer.assign(w[i]);
+	}
+};
+
+template <int... Sizes>
+class StaticNetwork {
+	static_assert(sizeof...(Sizes) >= 2, "A network needs at least an input and an output layer");
+
+	private:
+		StaticLayers<Sizes...>	layers;
+
+		void	assign(const vector<const double *> &w) {
+			layers.assign(w, 0);
+		}
+	public:
+		static const int	inputs = StaticLayers<Sizes...>::inputs;
+		static const int	outputs = StaticLayers<Sizes...>::outputs;
+
+		static vector<int>	getTopology() {
+			return vector<int>{Sizes...};
+		}
+
+		inline void	predict(const double *input, double *output) const {
+			layers.forward(input, output);
+		}
+
+		inline void	predict(const double (&input)[inputs], double (&output)[outputs]) const {
+			layers.forward(input, output);
+		}
+
+		// Reads a file written by NeuralNetwork::saveWeights(), throws when
+		// its topology is not Sizes...
+		void	loadWeights(const string &path) {
+			vector<int>				topology = getTopology();
+			vector<vector<double> >	buffers(topology.size() - 1);
+			vector<double *>		dst;
+			vector<const double *>	src;
+
+			for (size_t i = 0; i + 1 < topology.size(); i++) {
+				buffers[i].resize((size_t)topology[i] * topology[i + 1]);
+				dst.emplace_back(buffers[i].data());
+				src.emplace_back(buffers[i].data());
+			}
+			WeightsFile::read(path, topology, dst);
+			assign(src);
+		}
+
+		// Copies the weights of a dynamic network with the same topology
+		void	load(NeuralNetwork &nn) {
+			vector<const double *> src;
+
+			if (nn.getTopology() != getTopology()) {
+				throw invalid_argument("NeuralNetwork topology does not match the StaticNetwork");
+			}
+			for (size_t i = 0; i + 1 < sizeof...(Sizes); i++) {
+				src.emplace_back(nn.getWeights(i)->getLocalData());
+			}
+			assign(src);
+		}
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "WeightsFile.hpp"
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+void	WeightsFile::write(const string &path, const vector<int> &topology, const vector<const double *> &weights) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) {
+		throw runtime_error("Could not open " + path);
+	}
+	
+	uint32_t	count = topology.size();
+	bool		ok = fwrite("NNW1", 1, 4, f) == 4 && fwrite(&count, sizeof(count), 1, f) == 1;
+	
+	for (size_t i = 0; ok && i < topology.size(); i++) {
+		uint32_t size = topology[i];
+		ok = fwrite(&size, sizeof(size), 1, f) == 1;
+	}
+	for (size_t i = 0; ok && i + 1 < topology.size(); i++) {
+		size_t n = (size_t)topology[i] * topology[i + 1];
+		ok = fwrite(weights[i], sizeof(double), n, f) == n;
+	}
+	if (fclose(f) != 0 || !ok) {
+		throw runtime_error("Failed to write " + path);
+	}
+}
+
+void	WeightsFile::read(const string &path, const vector<int> &topology, const vector<double *> &weights) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		throw runtime_error("Could not open " + path);
+	}
+	
+	char		magic[4];
+	uint32_t	count = 0;
+	bool		ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, "NNW1", 4) == 0
+					&& fread(&count, sizeof(count), 1, f) == 1 && count == topology.size();
+	
+	for (size_t i = 0; ok && i < topology.size(); i++) {
+		uint32_t size = 0;
+		ok = fread(&size, sizeof(size), 1, f) == 1 && (int)size == topology[i];
+	}
+	if (!ok) {
+		fclose(f);
+		throw runtime_error("Topology in " + path + " does not match the network");
+	}
+	for (size_t i = 0; ok && i + 1 < topology.size(); i++) {
+		size_t n = (size_t)topology[i] * topology[i + 1];
+		ok = fread(weights[i], sizeof(double), n, f) == n;
+	}
+	fclose(f);
+	if (!ok) {
+		throw runtime_error("Truncated weights in " + path);
+	}
+}
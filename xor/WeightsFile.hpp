@@ -0,0 +1,19 @@
+#ifndef WEIGHTSFILE_HPP
+#define WEIGHTSFILE_HPP
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Weights shared by NeuralNetwork and StaticNetwork:
+// the 4 bytes "NNW1", uint32 layer count, uint32 size of every layer,
+// then for each pair of layers an (in x out) row-major block of doubles.
+class WeightsFile {
+	public:
+		static void	write(const string &path, const vector<int> &topology, const vector<const double *> &weights);
+		// Throws when the file is unreadable or its topology differs from `topology`
+		static void	read(const string &path, const vector<int> &topology, const vector<double *> &weights);
+};
+
+#endif
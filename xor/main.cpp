@@ -1,17 +1,86 @@
 # include "Layer.hpp" // IWYU pragma: keep
 # include "Matrix.hpp" // IWYU pragma: keep
 # include "NeuralNetwork.hpp" // IWYU pragma: keep
+# include "DataStream.hpp"
+# include "StaticNetwork.hpp"
 #include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
 
-int main()
+// Every member compiled, not only the ones main() calls
+template class StaticNetwork<3, 2, 3>;
+
+// The compile-time network has to agree with NeuralNetwork::predict() once
+// it holds the same weights; returns the largest difference.
+static double	compareStatic(NeuralNetwork *nn, const vector<double> &input) {
+	StaticNetwork<3, 2, 3>	sn;
+	double					expected[3], actual[3], diff = 0;
+	
+	sn.load(*nn);
+	nn->predict(input.data(), expected);
+	sn.predict(input.data(), actual);
+	for (int i = 0; i < 3; i++) {
+		diff = fmax(diff, fabs(expected[i] - actual[i]));
+	}
+	return diff;
+}
+
+// Streams the samples of `path` through the network for a few epochs,
+// the next chunk of the file is parsed while the current batch trains.
+static void	train(NeuralNetwork *nn, const char *path, int epochs, int batchSize, double rate) {
+	vector<int>	t = nn->getTopology();
+	DataStream	stream(path, t.front(), t.back(), batchSize, 4);
+	
+	for (int epoch = 0; epoch < epochs; epoch++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		double	loss = 0;
+		size_t	samples = 0, batches = 0;
+		
+		if (epoch > 0) {
+			stream.rewind();
+		}
+		for (const Batch *b = stream.next(); b; b = stream.next()) {
+			loss += nn->trainBatch(b->inputs.data(), b->targets.data(), b->size, rate);
+			samples += b->size;
+			batches++;
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "Epoch " << epoch + 1 << " loss: " << (batches ? loss / batches : 0)
+			<< " samples/s: " << samples / seconds
+			<< " MB/s: " << stream.getBytesRead() / seconds / 1e6 << endl;
+	}
+}
+
+int main(int argc, char **argv)
 {
 	vector<int> config = {3, 2, 3};
 	
 	vector<double> input = {1, 0, 1};
 	
 	NeuralNetwork *nn = new NeuralNetwork(config);
+	
+	// ./nn [samples.csv|samples.bin [epochs [batch size [learning rate]]]]
+	if (argc > 1) {
+		try {
+			train(nn, argv[1], argc > 2 ? atoi(argv[2]) : 1, argc > 3 ? atoi(argv[3]) : 32,
+				argc > 4 ? atof(argv[4]) : 0.5);
+		} catch (const exception &e) {
+			cerr << "Error: " << e.what() << endl;
+			delete nn;
+			return 1;
+		}
+	}
 	nn->setCurrnetInput(input);
 	
 	nn->print();
+	
+	double diff = compareStatic(nn, input);
+	cout << "StaticNetwork<3, 2, 3> vs NeuralNetwork: max diff " << diff << endl;
+	if (diff > 1e-12) {
+		cerr << "StaticNetwork does not match NeuralNetwork::predict()" << endl;
+		return 1;
+	}
 	return 0;
-}
\ No newline at end of file
+}